@@ -1,4 +1,5 @@
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
@@ -6,52 +7,1974 @@
 #include <linux/ioctl.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/jump_label.h>
+#include <linux/log2.h>
+#include <linux/sysfs.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/wait_bit.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/uio.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/eventfd.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/hrtimer.h>
+#include <linux/llist.h>
+
+#include "int_stack.h"
+
+#define CREATE_TRACE_POINTS
+#include "int_stack_trace.h"
 
 #define DEVICE_NAME "int_stack"
 #define IOCTL_SET_SIZE _IOW('s', 1, int)
+#define IOCTL_SET_MODE _IOW('s', 2, int)
+#define IOCTL_SET_ENDS _IOW('s', 3, int)
+#define IOCTL_GET_SUM _IOR('s', 4, long long)
+#define IOCTL_GET_MIN _IOR('s', 5, int)
+#define IOCTL_GET_MAX _IOR('s', 6, int)
+#define IOCTL_COUNT_VALUE _IOWR('s', 7, long long)
+#define IOCTL_SET_EVENTFD _IOW('s', 8, int)
+#define IOCTL_SET_NOTIFY_HIGH _IOW('s', 9, int)
+#define IOCTL_SET_NOTIFY_LOW _IOW('s', 10, int)
+#define IOCTL_POP_TIMEOUT _IOWR('s', 11, struct stack_pop_timeout)
+#define IOCTL_POP_TIMEOUT_BATCH _IOWR('s', 12, struct stack_pop_batch)
+#define IOCTL_GET_DEPTH _IOR('s', 13, int)
+#define IOCTL_GET_SIZE _IOR('s', 14, int)
+#define IOCTL_PEEK _IOR('s', 15, int)
+
+// IOCTL_POP_TIMEOUT argument. A negative timeout waits without deadline,
+// zero does not wait at all.
+struct stack_pop_timeout {
+    __s64 timeout_ns;
+    __s32 value;   // out: the popped element
+    __s32 reserved;
+};
+
+// IOCTL_POP_TIMEOUT_BATCH argument, pops up to count elements to addr
+// once at least one is available
+struct stack_pop_batch {
+    __s64 timeout_ns;
+    __u64 addr;
+    __u32 count;
+    __u32 popped;  // out
+};
+
+// io_uring command opcodes, passed in sqe->cmd_op of IORING_OP_URING_CMD
+#define STACK_CMD_PUSH 1       // push value
+#define STACK_CMD_POP 2        // pop up to count elements into addr, waits while empty
+#define STACK_CMD_PEEK 3       // store the element the next pop would return at addr
+#define STACK_CMD_PUSH_BATCH 4 // push count elements from addr
+
+// io_uring command payload, in the SQE's cmd area
+struct stack_uring_cmd {
+    __u64 addr;
+    __u32 count;
+    __s32 value;
+};
+
+// Stack modes for IOCTL_SET_MODE
+#define STACK_MODE_LIFO 0
+#define STACK_MODE_DEQUE 1
+#define STACK_MODE_FIFO 2
+#define STACK_MODE_FIFO_SPSC 3
+#define STACK_MODE_OVERWRITE 4
+#define STACK_MODE_MAX_HEAP 5
+#define STACK_MODE_MIN_HEAP 6
+
+// Per-file end selection for IOCTL_SET_ENDS, deque mode only
+#define STACK_PUSH_BOTTOM 0x1
+#define STACK_POP_BOTTOM 0x2
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Daria Shibkova");
 
-// Stack data structure with mutex protection
+// Upper bound for the adaptive spin of blocking pops, can be changed at
+// runtime via /sys/module/int_stack/parameters/
+static unsigned int spin_max_ns;
+module_param(spin_max_ns, uint, 0644);
+MODULE_PARM_DESC(spin_max_ns, "Max ns a blocking pop spins before sleeping (0: always sleep)");
+
+// Shortest spin worth doing once spinning pays off at all
+#define STACK_SPIN_MIN_NS 1000
+
+// Implementation of stack->lock, chosen at load time
+static char *lock_type = "mutex";
+module_param(lock_type, charp, 0444);
+MODULE_PARM_DESC(lock_type, "Stack lock: mutex, spinlock (queued) or raw_spinlock (no snapshots)");
+
+// Ring storage, refcounted so that a snapshot can keep streaming it after
+// a resize replaced it, and freed after a grace period for lock-free peeks
+struct stack_buf {
+    struct kref ref;
+    struct rcu_head rcu;
+    unsigned int mask; // ring slots - 1
+    int data[];
+};
+
+// Stack data structure with mutex protection.
+// Elements live in a power-of-two ring indexed by free-running positions:
+// the bottom element is at head, the top one at top - 1, so both ends can
+// grow and shrink in O(1).
 struct stack {
-    int *data;
-    int top;
+    struct stack_buf __rcu *buf;
+    int *data;         // buf->data, or NULL before the first resize
+    unsigned int head; // position of the bottom element
+    unsigned int top;  // position one past the top element
+    unsigned int mask; // ring slots - 1
+    int size;          // capacity in elements, at most mask + 1
+    int mode;
+    int spsc;          // lock-free SPSC state, see stack_config_begin()
+    struct task_struct *spsc_producer; // owner of the lock-free push side, see stack_spsc_claim()
+    struct task_struct *spsc_consumer; // owner of the lock-free pop side
+    bool spsc_shared;  // a second producer or consumer turned up
+    struct mutex config_lock; // serializes resizes and mode changes
+    seqcount_t layout_seq;    // bumped under the lock when elements move, see stack_peek()
+    int high_watermark;
+    int lock_type;     // enum stack_lock_type, fixed after load
+    union {
+        struct mutex lock;
+        spinlock_t spin;
+        raw_spinlock_t raw_spin;
+    };
+    u64 lock_acquired; // lock timing: when the current holder got the lock
+    int lock_op;       // lock timing: operation type of the current holder
+    int backend;
+    int growth_policy;
+    struct list_head snapshots; // open snapshots, under the lock
+    unsigned int resize_head;   // start of the range a resize copied ahead
+    unsigned int resize_valid;  // how much of it is still unmodified, under the lock
+    spinlock_t uring_lock;
+    struct list_head uring_waiters; // io_uring pops waiting for a push
+    struct eventfd_ctx __rcu *eventfd; // signalled by stack_notify()
+    int notify_high;   // signal when depth rises to this, 0 disables
+    int notify_low;    // signal when depth falls to this, -1 disables
+    struct fasync_struct *fasync; // SIGIO on empty to non-empty
+    wait_queue_head_t wait;        // pops waiting for a push
+    u64 last_push;     // local_clock() of the last push, while spinning is enabled
+    u64 push_gap_ns;   // moving average of the time between pushes
+    struct llist_head fc_requests; // flat combining: published, not yet applied
+};
+
+// Point-in-time view of the stack taken when the snapshot node is opened.
+// Positions [cursor, top) of buf are still to be streamed. A writer about
+// to overwrite one of them first preserves the enclosing block, so the
+// reader never needs the stack lock and writers never wait for a copy.
+struct stack_snapshot {
+    struct list_head node;
+    spinlock_t lock;     // orders preserving blocks against streaming them
+    struct stack_buf *buf;
+    unsigned int mask;
+    unsigned int cursor;
+    unsigned int top;
+    unsigned int block;  // elements per block, a power of two
+    int **blocks;        // preserved copies indexed by block number
+    bool broken;         // a block could not be preserved
+    int mode;            // stack mode and capacity when pinned
     int size;
-    struct mutex lock;
+};
+
+// Header of the stack image read from and written to debugfs, followed
+// by depth native-endian ints from bottom to top
+#define STACK_IMAGE_MAGIC 0x4b545349 // "ISTK"
+#define STACK_IMAGE_VERSION 1
+
+struct stack_image_header {
+    u32 magic;
+    u32 version;
+    u32 mode;
+    u32 size;
+    u32 depth;
+    u32 reserved;
+};
+
+// A STACK_CMD_POP waiting for a push, kept in the command's pdu
+struct stack_uring_pdu {
+    struct list_head node; // on stack->uring_waiters, under uring_lock
+    u64 addr;
+    u32 count;
+};
+
+// Per-open state of the debugfs image file
+struct stack_image {
+    struct stack_image_header header;
+    unsigned int header_pos;       // header bytes transferred so far
+    struct stack_snapshot *snap;   // readers only
+};
+
+// Lock implementations selectable through the lock_type module parameter
+enum stack_lock_type {
+    STACK_LOCK_MUTEX,
+    STACK_LOCK_SPINLOCK,
+    STACK_LOCK_RAW_SPINLOCK,
+};
+
+static const char * const stack_lock_type_names[] = {
+    [STACK_LOCK_MUTEX] = "mutex",
+    [STACK_LOCK_SPINLOCK] = "spinlock",
+    [STACK_LOCK_RAW_SPINLOCK] = "raw_spinlock",
+};
+
+// Synchronization backends selectable through sysfs
+enum stack_backend {
+    STACK_BACKEND_LOCKED,         // every operation under stack->lock
+    STACK_BACKEND_FLAT_COMBINING, // pushes and pops applied in batches by one lock holder
+};
+
+static const char * const stack_backend_names[] = {
+    [STACK_BACKEND_LOCKED] = "locked",
+    [STACK_BACKEND_FLAT_COMBINING] = "flat_combining",
+};
+
+// What a push onto a full stack does
+enum stack_growth {
+    STACK_GROWTH_FIXED,  // fail with -ERANGE
+    STACK_GROWTH_DOUBLE, // double the capacity and retry
+};
+
+static const char * const stack_growth_names[] = {
+    [STACK_GROWTH_FIXED] = "fixed",
+    [STACK_GROWTH_DOUBLE] = "double",
+};
+
+static const char * const stack_mode_names[] = {
+    [STACK_MODE_LIFO] = "lifo",
+    [STACK_MODE_DEQUE] = "deque",
+    [STACK_MODE_FIFO] = "fifo",
+    [STACK_MODE_FIFO_SPSC] = "fifo-spsc",
+    [STACK_MODE_OVERWRITE] = "overwrite",
+    [STACK_MODE_MAX_HEAP] = "max-heap",
+    [STACK_MODE_MIN_HEAP] = "min-heap",
+};
+
+// In fifo-spsc mode a single producer and a single consumer work on the
+// ring without the lock, publishing top and head with release stores;
+// any further task drops the stack back to locking, see stack_spsc_claim().
+// Configuration changes pause them: new operations wait while an RCU
+// grace period drains the ones in flight.
+enum stack_spsc {
+    STACK_SPSC_OFF,    // every operation takes the lock
+    STACK_SPSC_ON,     // push/pop run lock-free
+    STACK_SPSC_PAUSED, // a configuration change is in progress, or a long
+                       // one stopped locked push/pop too, see stack_pause()
+};
+
+// Per-open-file state
+struct stack_file {
+    unsigned int ends; // STACK_PUSH_BOTTOM / STACK_POP_BOTTOM
+};
+
+// Aggregate scans reschedule after this many elements
+#define STACK_SCAN_BLOCK 65536
+
+// Minor number of the read-only snapshot node and its copy chunk size
+#define STACK_SNAPSHOT_MINOR 1
+#define STACK_SNAPSHOT_CHUNK (64 * 1024)
+#define STACK_SNAPSHOT_BLOCK (PAGE_SIZE / sizeof(int))
+
+// Smallest capacity the double growth policy grows an unsized stack to
+#define STACK_GROWTH_MIN 16
+
+// Largest capacity, its power-of-two ring has to stay below the INT_MAX
+// bytes kvmalloc() accepts without warning
+#define STACK_SIZE_MAX (1 << 28)
+
+// Operation types used to bucket lock wait and hold times
+enum stack_op {
+    STACK_OP_PUSH,
+    STACK_OP_POP,
+    STACK_OP_RESIZE,
+    STACK_OP_QUERY,
+    STACK_OP_OTHER,
+    STACK_OP_COUNT,
+};
+
+static const char * const stack_op_names[STACK_OP_COUNT] = {
+    [STACK_OP_PUSH] = "push",
+    [STACK_OP_POP] = "pop",
+    [STACK_OP_RESIZE] = "resize",
+    [STACK_OP_QUERY] = "query",
+    [STACK_OP_OTHER] = "other",
+};
+
+// Per-CPU log2 histograms of lock wait and hold times in nanoseconds,
+// bucket b counts durations in [2^(b-1), 2^b)
+#define STACK_HIST_BUCKETS 64
+
+struct stack_lock_hist {
+    u64 wait[STACK_OP_COUNT][STACK_HIST_BUCKETS];
+    u64 hold[STACK_OP_COUNT][STACK_HIST_BUCKETS];
+};
+
+// Per-CPU operation counters, summed over all CPUs when read from debugfs
+struct stack_stats {
+    u64 pushes;
+    u64 pops;
+    u64 empty_pops;
+    u64 full_pushes;
+    u64 overwrites;
+    u64 resizes;
+    u64 bytes_copied;
+    u64 contended;
+    u64 spurious_wakeups; // woken consumers that found the stack empty
+    u64 spin_hits;     // blocking pops served by spinning
+    u64 spin_misses;   // blocking pops that spun and then slept
+    u64 combined;      // flat combining: requests applied for another thread
 };
 
 static struct stack *stack;
 static int major_number;
 static struct class *stack_class;
 static struct device *stack_device;
+static struct device *stack_snapshot_device;
+static const struct file_operations stack_snapshot_fops;
+static struct dentry *stack_debugfs;
+static DEFINE_PER_CPU(struct stack_stats, stack_stats);
+static DEFINE_PER_CPU(struct stack_lock_hist, stack_lock_hist);
+static DEFINE_STATIC_KEY_FALSE(stack_lock_timing);
+
+static unsigned int stack_hist_bucket(u64 ns) {
+    return min_t(unsigned int, fls64(ns), STACK_HIST_BUCKETS - 1);
+}
+
+// Take the stack lock, counting acquisitions that had to wait
+static void __stack_lock(struct stack *s) {
+    switch (s->lock_type) {
+    case STACK_LOCK_SPINLOCK:
+        if (!spin_trylock(&s->spin)) {
+            this_cpu_inc(stack_stats.contended);
+            spin_lock(&s->spin);
+        }
+        break;
+    case STACK_LOCK_RAW_SPINLOCK:
+        if (!raw_spin_trylock(&s->raw_spin)) {
+            this_cpu_inc(stack_stats.contended);
+            raw_spin_lock(&s->raw_spin);
+        }
+        break;
+    default:
+        if (!mutex_trylock(&s->lock)) {
+            this_cpu_inc(stack_stats.contended);
+            mutex_lock(&s->lock);
+        }
+        break;
+    }
+}
+
+static void __stack_unlock(struct stack *s) {
+    switch (s->lock_type) {
+    case STACK_LOCK_SPINLOCK:
+        spin_unlock(&s->spin);
+        break;
+    case STACK_LOCK_RAW_SPINLOCK:
+        raw_spin_unlock(&s->raw_spin);
+        break;
+    default:
+        mutex_unlock(&s->lock);
+        break;
+    }
+}
+
+// Whether the lock holder may sleep. Nothing under a spinning lock may:
+// allocations happen before taking it and frees after dropping it.
+static inline bool stack_lock_sleeps(const struct stack *s) {
+    return s->lock_type == STACK_LOCK_MUTEX;
+}
+
+// Take the stack lock for an operation of the given type, recording the
+// wait time when lock timing is enabled
+static void stack_lock(struct stack *s, enum stack_op op) {
+    u64 start;
+    
+    if (static_branch_unlikely(&stack_lock_timing)) {
+        start = ktime_get_ns();
+        __stack_lock(s);
+        s->lock_acquired = ktime_get_ns();
+        s->lock_op = op;
+        this_cpu_inc(stack_lock_hist.wait[op][stack_hist_bucket(s->lock_acquired - start)]);
+        return;
+    }
+    
+    __stack_lock(s);
+}
+
+// Take the stack lock if it is free, without counting contention
+static bool stack_trylock(struct stack *s, enum stack_op op) {
+    bool locked;
+    
+    switch (s->lock_type) {
+    case STACK_LOCK_SPINLOCK:
+        locked = spin_trylock(&s->spin);
+        break;
+    case STACK_LOCK_RAW_SPINLOCK:
+        locked = raw_spin_trylock(&s->raw_spin);
+        break;
+    default:
+        locked = mutex_trylock(&s->lock);
+        break;
+    }
+    
+    if (locked && static_branch_unlikely(&stack_lock_timing)) {
+        s->lock_acquired = ktime_get_ns();
+        s->lock_op = op;
+        this_cpu_inc(stack_lock_hist.wait[op][0]);
+    }
+    return locked;
+}
+
+// Release the stack lock, recording the hold time when the holder was timed
+static void stack_unlock(struct stack *s) {
+    u64 hold;
+    int op;
+    
+    if (static_branch_unlikely(&stack_lock_timing) && s->lock_acquired) {
+        hold = ktime_get_ns() - s->lock_acquired;
+        op = s->lock_op;
+        s->lock_acquired = 0;
+        __stack_unlock(s);
+        this_cpu_inc(stack_lock_hist.hold[op][stack_hist_bucket(hold)]);
+        return;
+    }
+    
+    __stack_unlock(s);
+}
+
+static inline int stack_depth(const struct stack *s) {
+    return s->top - s->head;
+}
+
+// Depth without the lock, only a hint by the time the caller looks at it.
+// The ends are read one after the other, so a bottom push racing with a
+// top pop can make the difference negative.
+static inline int stack_depth_hint(const struct stack *s) {
+    int depth = READ_ONCE(s->top) - READ_ONCE(s->head);
+    
+    return max(depth, 0);
+}
+
+static inline int *stack_slot(const struct stack *s, unsigned int pos) {
+    return &s->data[pos & s->mask];
+}
+
+// Copy n elements starting at position pos into a linear buffer,
+// this takes at most two memcpys when the range wraps around the ring
+static void stack_copy_out(const struct stack *s, int *dst, unsigned int pos, unsigned int n) {
+    unsigned int slot = pos & s->mask;
+    unsigned int first = min(n, s->mask + 1 - slot);
+    
+    memcpy(dst, s->data + slot, first * sizeof(int));
+    memcpy(dst + first, s->data, (n - first) * sizeof(int));
+}
+
+// Copy n elements starting at position pos into a ring of another size,
+// keeping their positions
+static void stack_relocate(const struct stack *s, int *dst, unsigned int mask, unsigned int pos, unsigned int n) {
+    unsigned int src_slot, dst_slot, len;
+    
+    while (n) {
+        src_slot = pos & s->mask;
+        dst_slot = pos & mask;
+        len = min3(n, s->mask + 1 - src_slot, mask + 1 - dst_slot);
+        memcpy(dst + dst_slot, s->data + src_slot, len * sizeof(int));
+        pos += len;
+        n -= len;
+    }
+}
+
+static void stack_buf_release(struct kref *ref) {
+    struct stack_buf *buf = container_of(ref, struct stack_buf, ref);
+    
+    kvfree_rcu(buf, rcu);
+}
+
+static void stack_buf_put(struct stack_buf *buf) {
+    if (buf)
+        kref_put(&buf->ref, stack_buf_release);
+}
+
+// Whether any position still to be streamed maps into block b
+static bool stack_snapshot_pending(const struct stack_snapshot *snap, unsigned int b) {
+    unsigned int first = b * snap->block;
+    unsigned int slot = snap->cursor & snap->mask;
+    unsigned int len = snap->top - snap->cursor;
+    
+    if (!len)
+        return false;
+    if (slot >= first && slot < first + snap->block)
+        return true;
+        
+    // Otherwise the pending range can only enter the block at its first slot
+    return ((first - slot) & snap->mask) < len;
+}
+
+// Preserve the snapshot blocks that writing n slots from position pos is
+// about to clobber. Caller holds the lock, so allocations must not sleep;
+// if one fails the snapshot is marked broken instead of stalling writers.
+static void stack_snapshot_cow(struct stack *s, unsigned int pos, unsigned int n) {
+    struct stack_snapshot *snap;
+    unsigned int i, slot, b;
+    int *copy;
+    
+    n = min(n, s->mask + 1);
+    list_for_each_entry(snap, &s->snapshots, node) {
+        // A resize since the snapshot was taken left its buffer alone
+        if (snap->buf != rcu_access_pointer(s->buf))
+            continue;
+            
+        spin_lock(&snap->lock);
+        for (i = 0; i < n && !snap->broken; i += snap->block - slot % snap->block) {
+            slot = (pos + i) & s->mask;
+            b = slot / snap->block;
+            if (snap->blocks[b] || !stack_snapshot_pending(snap, b))
+                continue;
+                
+            copy = kmalloc_array(snap->block, sizeof(int), GFP_NOWAIT | __GFP_NOWARN);
+            if (!copy) {
+                snap->broken = true;
+                break;
+            }
+            memcpy(copy, s->data + b * snap->block, snap->block * sizeof(int));
+            snap->blocks[b] = copy;
+        }
+        spin_unlock(&snap->lock);
+    }
+}
+
+// A store into the range a pending resize already copied means that part
+// has to be copied again under the lock
+static void stack_resize_dirty(struct stack *s, unsigned int pos, unsigned int n) {
+    int off = pos - s->resize_head;
+    
+    if (off < (int)s->resize_valid && off + (int)n > 0)
+        s->resize_valid = max(off, 0);
+}
+
+// Call before storing n elements from position pos
+static inline void stack_cow(struct stack *s, unsigned int pos, unsigned int n) {
+    if (unlikely(s->resize_valid))
+        stack_resize_dirty(s, pos, n);
+    if (unlikely(!list_empty(&s->snapshots)))
+        stack_snapshot_cow(s, pos, n);
+}
+
+// Initialize device on open
+static int stack_open(struct inode *inode, struct file *file) {
+    struct stack_file *sf;
+    
+    if (iminor(inode) == STACK_SNAPSHOT_MINOR) {
+        replace_fops(file, &stack_snapshot_fops);
+        return file->f_op->open(inode, file);
+    }
+    
+    sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+    if (!sf)
+        return -ENOMEM;
+        
+    file->private_data = sf;
+    return 0;
+}
+
+// Add or remove file from the SIGIO recipients, the VFS also calls this
+// with on == 0 when a FASYNC file is closed
+static int stack_fasync(int fd, struct file *file, int on) {
+    return fasync_helper(fd, file, on, &stack->fasync);
+}
+
+// Cleanup on device close
+static int stack_release(struct inode *inode, struct file *file) {
+    kfree(file->private_data);
+    return 0;
+}
+
+// Signal the registered eventfd when the depth went from old to new
+// across a transition worth waking a monitor for: empty to non-empty,
+// rising to the high or falling to the low notification mark, or full.
+// SIGIO is only sent for empty to non-empty. Called after the lock is
+// dropped, steady pushes and pops stay quiet.
+static void stack_notify(struct stack *s, int old, int new) {
+    int high = READ_ONCE(s->notify_high);
+    int low = READ_ONCE(s->notify_low);
+    struct eventfd_ctx *ctx;
+    
+    if (old == new)
+        return;
+        
+    if (old == 0)
+        kill_fasync(&s->fasync, SIGIO, POLL_IN);
+        
+    if (!rcu_access_pointer(s->eventfd))
+        return;
+        
+    if (!(old == 0 ||
+          (high > 0 && old < high && new >= high) ||
+          (low >= 0 && old > low && new <= low) ||
+          new == READ_ONCE(s->size)))
+        return;
+        
+    rcu_read_lock();
+    ctx = rcu_dereference(s->eventfd);
+    if (ctx)
+        eventfd_signal(ctx);
+    rcu_read_unlock();
+}
+
+// Replace the eventfd signalled by stack_notify(), fd < 0 unregisters
+static int stack_set_eventfd(struct stack *s, int fd) {
+    struct eventfd_ctx *ctx = NULL, *old;
+    
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+    
+    mutex_lock(&s->config_lock);
+    old = rcu_replace_pointer(s->eventfd, ctx, lockdep_is_held(&s->config_lock));
+    mutex_unlock(&s->config_lock);
+    
+    if (old) {
+        synchronize_rcu();
+        eventfd_ctx_put(old);
+    }
+    return 0;
+}
+
+// Start a configuration change: serialize against other changes and
+// stop lock-free operations until stack_config_end()
+static void stack_config_begin(struct stack *s) {
+    mutex_lock(&s->config_lock);
+    
+    if (s->spsc == STACK_SPSC_ON) {
+        WRITE_ONCE(s->spsc, STACK_SPSC_PAUSED);
+        synchronize_rcu();
+    }
+}
+
+// Finish a configuration change, re-enabling lock-free operations if
+// the stack is (still or now) in fifo-spsc mode. Lock-free pushes bypass
+// stack_cow(), so they stay off while a snapshot is open.
+static void stack_config_end(struct stack *s) {
+    int spsc = STACK_SPSC_OFF;
+    
+    if (s->mode == STACK_MODE_FIFO_SPSC && list_empty(&s->snapshots) &&
+        !s->spsc_shared)
+        spsc = STACK_SPSC_ON;
+        
+    if (s->spsc != spsc) {
+        // Under the lock, so no locked operation is halfway through
+        stack_lock(s, STACK_OP_OTHER);
+        WRITE_ONCE(s->spsc, spsc);
+        stack_unlock(s);
+        wake_up_var(&s->spsc);
+    }
+    
+    mutex_unlock(&s->config_lock);
+}
+
+// Wait for a configuration change that paused lock-free operations
+static void stack_spsc_wait(struct stack *s) {
+    wait_var_event(&s->spsc, READ_ONCE(s->spsc) != STACK_SPSC_PAUSED);
+}
+
+// Stop locked push and pop as well until stack_config_end(), so that a
+// long configuration change can drop a spinning lock now and then with
+// stack_lock_break(). Caller is inside the change and holds the lock.
+static void stack_pause(struct stack *s) {
+    if (!stack_lock_sleeps(s))
+        WRITE_ONCE(s->spsc, STACK_SPSC_PAUSED);
+}
+
+// Give up the CPU in the middle of a long operation. A spinning lock is
+// dropped meanwhile, the caller paused everything that would take it
+// with stack_pause().
+static void stack_lock_break(struct stack *s, enum stack_op op) {
+    if (stack_lock_sleeps(s)) {
+        cond_resched();
+        return;
+    }
+    
+    stack_unlock(s);
+    cond_resched();
+    stack_lock(s, op);
+}
+
+// Unlocked copy passes a resize makes before it settles for copying the
+// rest under the lock
+#define STACK_RESIZE_PASSES 4
+
+// stack_relocate() for the final copy of a resize, which holds the lock:
+// long copies are split into blocks with lock breaks in between
+static void stack_relocate_long(struct stack *s, int *dst, unsigned int mask, unsigned int pos, unsigned int n) {
+    unsigned int len;
+    
+    if (n > STACK_SCAN_BLOCK)
+        stack_pause(s);
+    while (n) {
+        len = min_t(unsigned int, n, STACK_SCAN_BLOCK);
+        stack_relocate(s, dst, mask, pos, len);
+        pos += len;
+        n -= len;
+        if (n)
+            stack_lock_break(s, STACK_OP_RESIZE);
+    }
+}
+
+// Reallocate the stack storage, keeping as many bottom elements as fit.
+// Caller is inside a configuration change.
+//
+// The bulk of the copy runs without the lock: the current contents are
+// copied ahead while pushes and pops carry on, and stack_cow() notes
+// stores into the copied range. Elements keep their positions so pops
+// from the bottom don't invalidate the early copy. What changed or was
+// pushed since is copied again, without the lock while that is still a
+// lot, and the last few elements under it. Heap pops rewrite the root
+// every time, so churn can keep the remainder large; the final copy
+// then pauses the stack and breaks the lock between blocks.
+static int __stack_resize(struct stack *s, int new_size) {
+    struct stack_buf *new_buf, *old_buf;
+    unsigned int slots = roundup_pow_of_two(new_size);
+    unsigned int head;
+    int old_size, old_depth, copied, lo, hi, pass;
+    u64 start = 0;
+    
+    if (new_size > STACK_SIZE_MAX)
+        return -EINVAL;
+        
+    if (trace_int_stack_resize_enabled())
+        start = ktime_get_ns();
+        
+    // Allocate new memory for the stack before taking the lock, which may
+    // be a spinlock
+    new_buf = kvmalloc(struct_size(new_buf, data, slots), GFP_KERNEL);
+    if (!new_buf)
+        return -ENOMEM;
+    kref_init(&new_buf->ref);
+    new_buf->mask = slots - 1;
+    
+    for (pass = 0; ; pass++) {
+        stack_lock(s, STACK_OP_RESIZE);
+        
+        // What the copy doesn't cover yet: anything pushed below its start
+        // and anything past the part of it that stayed unmodified
+        old_depth = stack_depth(s);
+        copied = min(old_depth, new_size);
+        lo = clamp((int)(s->resize_head - s->head), 0, copied);
+        hi = clamp((int)(s->resize_head + s->resize_valid - s->head), lo, copied);
+        if (pass && (copied - (hi - lo) <= STACK_SCAN_BLOCK || pass == STACK_RESIZE_PASSES))
+            break;
+            
+        head = s->head;
+        s->resize_head = head;
+        s->resize_valid = copied;
+        stack_unlock(s);
+        
+        // Nothing else replaces the old buffer during a configuration
+        // change, stores racing with this copy are caught by
+        // stack_resize_dirty()
+        stack_relocate(s, new_buf->data, slots - 1, head, lo);
+        stack_relocate(s, new_buf->data, slots - 1, head + hi, copied - hi);
+        this_cpu_add(stack_stats.bytes_copied, (copied - (hi - lo)) * sizeof(int));
+    }
+    
+    s->resize_valid = 0;
+    stack_relocate_long(s, new_buf->data, slots - 1, s->head, lo);
+    stack_relocate_long(s, new_buf->data, slots - 1, s->head + hi, copied - hi);
+    this_cpu_add(stack_stats.bytes_copied, (copied - (hi - lo)) * sizeof(int));
+    
+    // Lock-free peeks that overlap the switch retry, the old buffer stays
+    // readable to them until a grace period has passed
+    preempt_disable();
+    write_seqcount_begin(&s->layout_seq);
+    old_buf = rcu_dereference_protected(s->buf, true);
+    old_size = s->size;
+    rcu_assign_pointer(s->buf, new_buf);
+    s->data = new_buf->data;
+    s->mask = slots - 1;
+    WRITE_ONCE(s->size, new_size);
+    WRITE_ONCE(s->top, s->head + copied);
+    write_seqcount_end(&s->layout_seq);
+    preempt_enable();
+    stack_unlock(s);
+    
+    // Open snapshots hold their own reference to the old buffer
+    stack_buf_put(old_buf);
+    stack_notify(s, old_depth, copied);
+    this_cpu_inc(stack_stats.resizes);
+    if (trace_int_stack_resize_enabled())
+        trace_int_stack_resize(old_size, new_size, copied, ktime_get_ns() - start);
+    return 0;
+}
+
+static int stack_resize(struct stack *s, int new_size) {
+    int ret;
+    
+    stack_config_begin(s);
+    ret = __stack_resize(s, new_size);
+    stack_config_end(s);
+    
+    return ret;
+}
+
+// Grow a full stack according to the growth policy, unless someone else
+// already changed its size. Returns -ERANGE if the policy forbids growing,
+// and -EAGAIN with nowait, since resizing sleeps.
+static int stack_grow(struct stack *s, int old_size, bool nowait) {
+    int ret = 0;
+    
+    if (READ_ONCE(s->growth_policy) != STACK_GROWTH_DOUBLE || old_size >= STACK_SIZE_MAX)
+        return -ERANGE;
+    if (nowait)
+        return -EAGAIN;
+        
+    stack_config_begin(s);
+    if (s->size == old_size)
+        ret = __stack_resize(s, clamp(old_size * 2, STACK_GROWTH_MIN, STACK_SIZE_MAX));
+    stack_config_end(s);
+    
+    return ret;
+}
+
+// Whether pushing n more elements onto depth would have to grow the stack,
+// which a nowait push can't do
+static bool stack_push_would_grow(struct stack *s, unsigned int depth, int n) {
+    return READ_ONCE(s->growth_policy) == STACK_GROWTH_DOUBLE &&
+           READ_ONCE(s->mode) != STACK_MODE_OVERWRITE &&
+           READ_ONCE(s->size) - (int)depth < n;
+}
+
+// Copy n elements from a linear buffer into the ring starting at position pos
+static void stack_copy_in(struct stack *s, unsigned int pos, const int *src, unsigned int n) {
+    unsigned int slot = pos & s->mask;
+    unsigned int first = min(n, s->mask + 1 - slot);
+    
+    stack_cow(s, pos, n);
+    memcpy(s->data + slot, src, first * sizeof(int));
+    memcpy(s->data, src + first, (n - first) * sizeof(int));
+}
+
+static inline bool stack_is_heap(const struct stack *s) {
+    return s->mode == STACK_MODE_MAX_HEAP || s->mode == STACK_MODE_MIN_HEAP;
+}
+
+// fifo-spsc also takes the locked paths while lock-free operation is off
+static inline bool stack_is_fifo(const struct stack *s) {
+    return s->mode == STACK_MODE_FIFO || s->mode == STACK_MODE_FIFO_SPSC;
+}
+
+// Heap index i lives at ring position head + i
+static inline int *stack_heap(const struct stack *s, unsigned int i) {
+    return stack_slot(s, s->head + i);
+}
+
+static inline void stack_heap_set(struct stack *s, unsigned int i, int value) {
+    stack_cow(s, s->head + i, 1);
+    *stack_heap(s, i) = value;
+}
+
+// Whether a belongs closer to the heap root than b
+static inline bool stack_heap_above(const struct stack *s, int a, int b) {
+    return s->mode == STACK_MODE_MAX_HEAP ? a > b : a < b;
+}
+
+static void stack_heap_sift_up(struct stack *s, unsigned int i) {
+    int value = *stack_heap(s, i);
+    unsigned int parent;
+    
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!stack_heap_above(s, value, *stack_heap(s, parent)))
+            break;
+        stack_heap_set(s, i, *stack_heap(s, parent));
+        i = parent;
+    }
+    stack_heap_set(s, i, value);
+}
+
+static void stack_heap_sift_down(struct stack *s, unsigned int i, unsigned int n) {
+    int value = *stack_heap(s, i);
+    unsigned int child;
+    
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && stack_heap_above(s, *stack_heap(s, child + 1), *stack_heap(s, child)))
+            child++;
+        if (!stack_heap_above(s, *stack_heap(s, child), value))
+            break;
+        stack_heap_set(s, i, *stack_heap(s, child));
+        i = child;
+    }
+    stack_heap_set(s, i, value);
+}
+
+// Bottom-up heap construction over the whole stack in O(n)
+static void stack_heapify(struct stack *s) {
+    unsigned int n = stack_depth(s);
+    unsigned int i;
+    
+    for (i = n / 2; i-- > 0; )
+        stack_heap_sift_down(s, i, n);
+}
+
+// stack_heapify() for a mode switch, which may cover the whole of a huge
+// stack, so it breaks the lock every STACK_SCAN_BLOCK subtrees. Caller is
+// inside a configuration change and paused operations with stack_pause().
+static void stack_heapify_long(struct stack *s) {
+    unsigned int n = stack_depth(s);
+    unsigned int i;
+    
+    for (i = n / 2; i-- > 0; ) {
+        stack_heap_sift_down(s, i, n);
+        if (i % STACK_SCAN_BLOCK == 0)
+            stack_lock_break(s, STACK_OP_OTHER);
+    }
+}
+
+// Store value according to the stack mode, caller holds the lock and made room
+// The new end is published with a release so that a lock-free peek that
+// sees it also sees the element.
+static void __stack_push(struct stack *s, int value, bool bottom) {
+    stack_cow(s, bottom ? s->head - 1 : s->top, 1);
+    if (bottom) {
+        *stack_slot(s, s->head - 1) = value;
+        smp_store_release(&s->head, s->head - 1);
+        return;
+    }
+    
+    *stack_slot(s, s->top) = value;
+    smp_store_release(&s->top, s->top + 1);
+    if (stack_is_heap(s))
+        stack_heap_sift_up(s, stack_depth(s) - 1);
+}
+
+// Remove the next element according to the stack mode, caller holds the
+// lock and checked that the stack is not empty. The ends are read without
+// the lock by stack_depth_hint() and stack_peek_lockless(), hence the
+// WRITE_ONCE()s.
+static int __stack_pop(struct stack *s, bool bottom) {
+    int value, last;
+    
+    if (stack_is_heap(s)) {
+        value = *stack_heap(s, 0);
+        WRITE_ONCE(s->top, s->top - 1);
+        last = *stack_slot(s, s->top);
+        if (stack_depth(s)) {
+            stack_heap_set(s, 0, last);
+            stack_heap_sift_down(s, 0, stack_depth(s));
+        }
+        return value;
+    }
+    
+    // FIFO modes always consume the oldest element
+    if (bottom || stack_is_fifo(s)) {
+        value = *stack_slot(s, s->head);
+        WRITE_ONCE(s->head, s->head + 1);
+        return value;
+    }
+    
+    WRITE_ONCE(s->top, s->top - 1);
+    return *stack_slot(s, s->top);
+}
+
+// Element the next pop from the given end would return, caller holds the
+// lock and checked that the stack is not empty
+static int __stack_peek(const struct stack *s, bool bottom) {
+    if (stack_is_heap(s))
+        return *stack_heap(s, 0);
+        
+    if ((bottom && s->mode == STACK_MODE_DEQUE) || stack_is_fifo(s))
+        return *stack_slot(s, s->head);
+        
+    return *stack_slot(s, s->top - 1);
+}
+
+// Lock-free operation is only safe with one task on each end. The first
+// task to push (pop) claims that end; the pointer is compared, never
+// dereferenced, so no reference is held.
+static bool stack_spsc_claim(struct task_struct **owner) {
+    struct task_struct *cur = READ_ONCE(*owner);
+    
+    if (cur == current)
+        return true;
+    return !cur && !cmpxchg(owner, NULL, current);
+}
+
+// Another task showed up on a claimed end: drain the lock-free operations
+// in flight and put everyone on the locked path until the next mode switch
+static void stack_spsc_share(struct stack *s) {
+    stack_config_begin(s);
+    s->spsc_shared = true;
+    stack_config_end(s);
+}
+
+// Lock-free push for fifo-spsc mode, only the producer moves top.
+// Pushes up to n values and returns how many fit, or -EAGAIN if lock-free
+// operation was switched off meanwhile.
+static int stack_spsc_push(struct stack *s, const int *values, int n) {
+    unsigned int top, depth;
+    int i, ret;
+    
+    rcu_read_lock();
+    
+    if (READ_ONCE(s->spsc) != STACK_SPSC_ON) {
+        ret = -EAGAIN;
+        goto out;
+    }
+    
+    // Pairs with the release of head in stack_spsc_pop(), the consumer is
+    // done with the slots before we overwrite them
+    top = READ_ONCE(s->top);
+    depth = top - smp_load_acquire(&s->head);
+    ret = min_t(unsigned int, n, s->size - depth);
+    if (!ret)
+        goto out;
+        
+    if (ret == 1)
+        *stack_slot(s, top) = values[0];
+    else
+        stack_copy_in(s, top, values, ret);
+    smp_store_release(&s->top, top + ret);
+    
+    if (depth + ret > READ_ONCE(s->high_watermark))
+        WRITE_ONCE(s->high_watermark, depth + ret);
+    if (trace_int_stack_push_enabled()) {
+        for (i = 0; i < ret; i++)
+            trace_int_stack_push(values[i], depth + i + 1);
+    }
+    stack_notify(s, depth, depth + ret);
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+// Lock-free pop for fifo-spsc mode, only the consumer moves head.
+// Pops up to n values and returns how many there were, or -EAGAIN if
+// lock-free operation was switched off meanwhile.
+static int stack_spsc_pop(struct stack *s, int *values, int n) {
+    unsigned int head, depth;
+    int i, ret;
+    
+    rcu_read_lock();
+    
+    if (READ_ONCE(s->spsc) != STACK_SPSC_ON) {
+        ret = -EAGAIN;
+        goto out;
+    }
+    
+    // Pairs with the release of top in stack_spsc_push(), the slots are
+    // written before we read them
+    head = READ_ONCE(s->head);
+    depth = smp_load_acquire(&s->top) - head;
+    ret = min_t(unsigned int, n, depth);
+    if (!ret) {
+        trace_int_stack_empty(s->size);
+        goto out;
+    }
+    
+    if (ret == 1)
+        values[0] = *stack_slot(s, head);
+    else
+        stack_copy_out(s, values, head, ret);
+    smp_store_release(&s->head, head + ret);
+    
+    if (trace_int_stack_pop_enabled()) {
+        for (i = 0; i < ret; i++)
+            trace_int_stack_pop(values[i], depth - i - 1);
+    }
+    stack_notify(s, depth, depth - ret);
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+// Push up to n values, caller holds the lock. Returns how many were
+// consumed, or -EAGAIN if the stack switched to lock-free operation while
+// we waited for the lock. *old is set to the depth before the push.
+static int __stack_locked_push(struct stack *s, const int *values, int n, bool bottom, unsigned int *old) {
+    unsigned int depth;
+    int room, drop, i, ret;
+    
+    if (unlikely(s->spsc != STACK_SPSC_OFF))
+        return -EAGAIN;
+        
+    // The end was picked before the lock, a mode switch since then turns
+    // a bottom push back into a top one
+    bottom = bottom && s->mode == STACK_MODE_DEQUE;
+    *old = depth = stack_depth(s);
+    room = s->size - depth;
+    ret = n;
+    
+    // Overwrite mode makes room by dropping bottom elements, of a batch
+    // larger than the stack only the newest values survive
+    if (s->mode == STACK_MODE_OVERWRITE && s->size && room < n) {
+        if (n > s->size) {
+            values += n - s->size;
+            n = s->size;
+        }
+        drop = n - room;
+        WRITE_ONCE(s->head, s->head + drop);
+        depth -= drop;
+        room = n;
+        this_cpu_add(stack_stats.overwrites, drop + ret - n);
+    }
+    
+    if (n > room)
+        n = ret = room;
+    if (!n)
+        return 0;
+        
+    
+    if (n == 1) {
+        __stack_push(s, values[0], bottom);
+    } else if (bottom) {
+        stack_cow(s, s->head - n, n);
+        for (i = 0; i < n; i++)
+            *stack_slot(s, s->head - 1 - i) = values[i];
+        smp_store_release(&s->head, s->head - n);
+    } else {
+        stack_copy_in(s, s->top, values, n);
+        smp_store_release(&s->top, s->top + n);
+        
+        // Rebuild the heap bottom-up when that is cheaper than sifting up
+        // every new element
+        if (stack_is_heap(s)) {
+            if ((u64)n * ilog2(depth + n) > depth + n) {
+                stack_heapify(s);
+            } else {
+                for (i = 0; i < n; i++)
+                    stack_heap_sift_up(s, depth + i);
+            }
+        }
+    }
+    
+    if (stack_depth(s) > s->high_watermark)
+        s->high_watermark = stack_depth(s);
+    if (trace_int_stack_push_enabled()) {
+        for (i = 0; i < n; i++)
+            trace_int_stack_push(values[i], depth + i + 1);
+    }
+    return ret;
+}
+
+// Pop up to n values, caller holds the lock. Returns how many there were,
+// or -EAGAIN if the stack switched to lock-free operation while we waited
+// for the lock. *old is set to the depth before the pop.
+static int __stack_locked_pop(struct stack *s, int *values, int n, bool bottom, unsigned int *old) {
+    unsigned int depth;
+    int i;
+    
+    if (unlikely(s->spsc != STACK_SPSC_OFF))
+        return -EAGAIN;
+        
+    // As in __stack_locked_push(), only deque mode has a bottom end
+    bottom = bottom && s->mode == STACK_MODE_DEQUE;
+    *old = depth = stack_depth(s);
+    if (depth == 0) {
+        trace_int_stack_empty(s->size);
+        return 0;
+    }
+    
+    if (n > depth)
+        n = depth;
+        
+    if (n > 1 && !stack_is_heap(s) && (bottom || stack_is_fifo(s))) {
+        stack_copy_out(s, values, s->head, n);
+        WRITE_ONCE(s->head, s->head + n);
+    } else {
+        for (i = 0; i < n; i++)
+            values[i] = __stack_pop(s, bottom);
+    }
+    
+    if (trace_int_stack_pop_enabled()) {
+        for (i = 0; i < n; i++)
+            trace_int_stack_pop(values[i], depth - i - 1);
+    }
+    return n;
+}
+
+// A push or pop published for the flat-combining backend. It lives on the
+// stack of the thread that made it, which spins until done is set.
+struct stack_fc_request {
+    struct llist_node node;
+    union {
+        const int *src; // push
+        int *dst;       // pop
+    };
+    int n;
+    bool push;
+    bool bottom;
+    int ret;
+    unsigned int old, new; // depth before and after, for stack_notify()
+    int done;
+};
+
+// Limit on passes over the request list per lock hold, so one combiner
+// doesn't serve a steady stream of requests forever
+#define STACK_FC_PASSES 4
+
+// Failed trylocks after which a requester stops spinning and blocks on the
+// lock, which may be held for long by a resize, scan or heapify
+#define STACK_FC_SPINS 128
+
+// Apply published requests in the order they were made, caller holds the
+// lock. The requests are applied in one go, so the stack stays cache hot
+// on the combining CPU instead of bouncing between all the requesters.
+static void stack_fc_combine(struct stack *s, struct stack_fc_request *own) {
+    struct stack_fc_request *req, *next;
+    struct llist_node *list;
+    int pass;
+    
+    for (pass = 0; pass < STACK_FC_PASSES; pass++) {
+        list = llist_del_all(&s->fc_requests);
+        if (!list)
+            break;
+            
+        llist_for_each_entry_safe(req, next, llist_reverse_order(list), node) {
+            if (req->push)
+                req->ret = __stack_locked_push(s, req->src, req->n, req->bottom, &req->old);
+            else
+                req->ret = __stack_locked_pop(s, req->dst, req->n, req->bottom, &req->old);
+            req->new = stack_depth(s);
+            
+            // The requester may return as soon as it sees done
+            if (req != own)
+                this_cpu_inc(stack_stats.combined);
+            smp_store_release(&req->done, 1);
+        }
+    }
+}
+
+// Publish a request and wait until some lock holder applied it, becoming
+// the combiner whenever the lock is free
+static int stack_fc_submit(struct stack *s, struct stack_fc_request *req) {
+    enum stack_op op = req->push ? STACK_OP_PUSH : STACK_OP_POP;
+    int spins = 0;
+    
+    llist_add(&req->node, &s->fc_requests);
+    
+    while (!smp_load_acquire(&req->done)) {
+        if (stack_trylock(s, op)) {
+            stack_fc_combine(s, req);
+            stack_unlock(s);
+        } else if (++spins >= STACK_FC_SPINS) {
+            // Our request is applied by the time we get the lock, by us
+            // if nobody else combined it meanwhile
+            stack_lock(s, op);
+            stack_fc_combine(s, req);
+            stack_unlock(s);
+        } else {
+            cpu_relax();
+        }
+    }
+    
+    if (req->ret > 0)
+        stack_notify(s, req->old, req->new);
+    return req->ret;
+}
+
+// Push up to n values under the lock and return how many were consumed.
+// Returns -EAGAIN if the stack switched to lock-free operation while we
+// waited for the lock. With nowait, returns -EBUSY if the lock is taken or
+// the values only fit after growing the stack.
+static int stack_locked_push(struct stack *s, const int *values, int n, bool bottom, bool nowait) {
+    unsigned int old, depth;
+    int ret;
+    
+    if (nowait) {
+        // A flat-combining request can't be taken back once queued, so
+        // both backends just try the lock
+        if (!stack_trylock(s, STACK_OP_PUSH))
+            return -EBUSY;
+        if (stack_push_would_grow(s, stack_depth(s), n)) {
+            stack_unlock(s);
+            return -EBUSY;
+        }
+    } else if (READ_ONCE(s->backend) == STACK_BACKEND_FLAT_COMBINING) {
+        struct stack_fc_request req = { .src = values, .n = n, .push = true, .bottom = bottom };
+        
+        return stack_fc_submit(s, &req);
+    } else {
+        stack_lock(s, STACK_OP_PUSH);
+    }
+    
+    ret = __stack_locked_push(s, values, n, bottom, &old);
+    depth = stack_depth(s);
+    stack_unlock(s);
+    
+    if (ret > 0)
+        stack_notify(s, old, depth);
+    return ret;
+}
+
+// Pop up to n values under the lock and return how many there were.
+// Returns -EAGAIN if the stack switched to lock-free operation while we
+// waited for the lock. With nowait, returns -EBUSY if the lock is taken.
+static int stack_locked_pop(struct stack *s, int *values, int n, bool bottom, bool nowait) {
+    unsigned int old, depth;
+    int ret;
+    
+    if (nowait) {
+        if (!stack_trylock(s, STACK_OP_POP))
+            return -EBUSY;
+    } else if (READ_ONCE(s->backend) == STACK_BACKEND_FLAT_COMBINING) {
+        struct stack_fc_request req = { .dst = values, .n = n, .bottom = bottom };
+        
+        return stack_fc_submit(s, &req);
+    } else {
+        stack_lock(s, STACK_OP_POP);
+    }
+    
+    ret = __stack_locked_pop(s, values, n, bottom, &old);
+    depth = stack_depth(s);
+    stack_unlock(s);
+    
+    if (ret > 0)
+        stack_notify(s, old, depth);
+    return ret;
+}
+
+static inline struct stack_uring_pdu *stack_uring_pdu(struct io_uring_cmd *ioucmd) {
+    return (struct stack_uring_pdu *)ioucmd->pdu;
+}
+
+static inline struct io_uring_cmd *stack_uring_cmd_of(struct stack_uring_pdu *pdu) {
+    return (struct io_uring_cmd *)((char *)pdu - offsetof(struct io_uring_cmd, pdu));
+}
+
+// 6.15 passes a task-work token instead of issue flags to task-work
+// callbacks, 6.18 moved res2 out of io_uring_cmd_done()
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+static void stack_uring_pop_task(struct io_uring_cmd *ioucmd, io_tw_token_t tw);
+#else
+static void stack_uring_pop_task(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+#endif
+
+static inline void stack_uring_done(struct io_uring_cmd *ioucmd, int ret, unsigned int issue_flags) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+    io_uring_cmd_done(ioucmd, ret, issue_flags);
+#else
+    io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+#endif
+}
+
+// Hand newly pushed elements to up to n queued io_uring pops. The pops are
+// retried in task context, where they can copy to their user buffers.
+// Caller issued a full barrier after the push and saw a queued pop.
+static void stack_uring_kick(struct stack *s, int n) {
+    struct stack_uring_pdu *pdu;
+    
+    spin_lock(&s->uring_lock);
+    while (n-- > 0 && !list_empty(&s->uring_waiters)) {
+        pdu = list_first_entry(&s->uring_waiters, struct stack_uring_pdu, node);
+        list_del_init(&pdu->node);
+        io_uring_cmd_complete_in_task(stack_uring_cmd_of(pdu), stack_uring_pop_task);
+    }
+    spin_unlock(&s->uring_lock);
+}
+
+// Feed the time since the previous push into the moving average that
+// sizes the spin of blocking pops. Updates from concurrent pushers may
+// be lost, which only makes the estimate a little noisier.
+static void stack_note_push(struct stack *s) {
+    u64 now = local_clock();
+    u64 last = READ_ONCE(s->last_push);
+    s64 gap, avg;
+    
+    WRITE_ONCE(s->last_push, now);
+    if (!last)
+        return;
+        
+    // local_clock() is only monotonic per CPU
+    gap = clamp_t(s64, now - last, 0, NSEC_PER_SEC);
+    avg = READ_ONCE(s->push_gap_ns);
+    WRITE_ONCE(s->push_gap_ns, avg + ((gap - avg) >> 3));
+}
+
+// Push n values at the top or, in deque mode, the bottom of the stack and
+// return how many were pushed. Returns -ERANGE when the stack is full.
+// With nowait, returns -EAGAIN instead of sleeping for the lock, a
+// configuration change or growing the stack.
+static int stack_push_batch(struct stack *s, const int *values, int n, bool bottom, bool nowait) {
+    int pushed = 0;
+    int size;
+    int ret = 0;
+    
+    while (pushed < n) {
+        switch (READ_ONCE(s->spsc)) {
+        case STACK_SPSC_ON:
+            if (!stack_spsc_claim(&s->spsc_producer)) {
+                if (nowait) {
+                    ret = -EBUSY;
+                    break;
+                }
+                stack_spsc_share(s);
+                continue;
+            }
+            // Only the claimed producer raises the depth, so the check
+            // can't go stale before the push
+            if (nowait && stack_push_would_grow(s, stack_depth_hint(s), n - pushed)) {
+                ret = -EBUSY;
+                break;
+            }
+            ret = stack_spsc_push(s, values + pushed, n - pushed);
+            break;
+        case STACK_SPSC_PAUSED:
+            if (nowait) {
+                ret = -EBUSY;
+                break;
+            }
+            stack_spsc_wait(s);
+            continue;
+        default:
+            ret = stack_locked_push(s, values + pushed, n - pushed, bottom, nowait);
+            break;
+        }
+        
+        if (ret == -EAGAIN)
+            continue;
+            
+        if (ret == -EBUSY) {
+            ret = -EAGAIN;
+            break;
+        }
+        
+        if (ret > 0) {
+            pushed += ret;
+            continue;
+        }
+        
+        // Full, grow according to the growth policy and try again
+        size = READ_ONCE(s->size);
+        ret = stack_grow(s, size, nowait);
+        if (ret) {
+            if (ret == -ERANGE) {
+                trace_int_stack_full(values[pushed], size);
+                this_cpu_inc(stack_stats.full_pushes);
+            }
+            break;
+        }
+    }
+    
+    this_cpu_add(stack_stats.pushes, pushed);
+    if (pushed) {
+        if (READ_ONCE(spin_max_ns))
+            stack_note_push(s);
+        // One barrier for both kinds of waiter, pairs with the ones in
+        // prepare_to_wait_exclusive() and stack_uring_pop(): either we see
+        // the waiter or it sees the new depth
+        smp_mb();
+        
+        // Consumers wait exclusively, wake one per element
+        if (waitqueue_active(&s->wait))
+            wake_up_interruptible_nr(&s->wait, pushed);
+        if (!list_empty(&s->uring_waiters))
+            stack_uring_kick(s, pushed);
+    }
+    return pushed ? pushed : ret;
+}
+
+// Pop up to n values from the top or, in deque mode, the bottom of the
+// stack and return how many were popped. FIFO modes always pop the bottom,
+// heap modes the highest priority element. With nowait, returns -EAGAIN
+// instead of sleeping for the lock or a configuration change.
+static int stack_pop_batch(struct stack *s, int *values, int n, bool bottom, bool nowait) {
+    int ret;
+    
+retry:
+    switch (READ_ONCE(s->spsc)) {
+    case STACK_SPSC_ON:
+        if (!stack_spsc_claim(&s->spsc_consumer)) {
+            if (nowait)
+                return -EAGAIN;
+            stack_spsc_share(s);
+            goto retry;
+        }
+        ret = stack_spsc_pop(s, values, n);
+        break;
+    case STACK_SPSC_PAUSED:
+        if (nowait)
+            return -EAGAIN;
+        stack_spsc_wait(s);
+        goto retry;
+    default:
+        ret = stack_locked_pop(s, values, n, bottom, nowait);
+        break;
+    }
+    
+    if (ret == -EAGAIN)
+        goto retry;
+    if (ret == -EBUSY)
+        return -EAGAIN;
+        
+    if (ret == 0)
+        this_cpu_inc(stack_stats.empty_pops);
+    else
+        this_cpu_add(stack_stats.pops, ret);
+    return ret;
+}
+
+// Push a single value, returns -ERANGE when the stack is full
+static int stack_push(struct stack *s, int value, bool bottom) {
+    int ret = stack_push_batch(s, &value, 1, bottom, false);
+    
+    return ret < 0 ? ret : 0;
+}
+
+// Pop a single value, returns -ENODATA when the stack is empty
+static int stack_pop(struct stack *s, int *value, bool bottom) {
+    return stack_pop_batch(s, value, 1, bottom, false) ? 0 : -ENODATA;
+}
+
+// Spin until the stack looks non-empty, for about twice the average gap
+// between pushes if that fits in spin_max_ns and before the deadline.
+// A handoff then costs no sleep/wakeup round trip, while an idle stack
+// is left to sleepers straight away.
+static bool stack_spin_wait(struct stack *s, ktime_t deadline) {
+    u64 max = READ_ONCE(spin_max_ns);
+    u64 gap = READ_ONCE(s->push_gap_ns);
+    s64 left = ktime_to_ns(ktime_sub(deadline, ktime_get()));
+    u64 start, budget;
+    
+    if (!max || !READ_ONCE(s->last_push) || gap > max || left <= 0)
+        return false;
+        
+    budget = min_t(u64, 2 * gap + STACK_SPIN_MIN_NS, max);
+    budget = min_t(u64, budget, left);
+    start = local_clock();
+    
+    while (local_clock() - start < budget && !need_resched()) {
+        if (stack_depth_hint(s)) {
+            this_cpu_inc(stack_stats.spin_hits);
+            return true;
+        }
+        cpu_relax();
+    }
+    
+    this_cpu_inc(stack_stats.spin_misses);
+    return false;
+}
+
+// Pop up to n elements, waiting up to timeout_ns (without deadline if
+// negative) for the stack to become non-empty. Returns the number popped,
+// -ETIMEDOUT or -ERESTARTSYS.
+static int stack_pop_timeout(struct stack *s, int *values, int n, bool bottom, s64 timeout_ns) {
+    ktime_t deadline = timeout_ns < 0 ? KTIME_MAX : ktime_add_safe(ktime_get(), ns_to_ktime(timeout_ns));
+    bool woken = false;
+    bool spun = false;
+    DEFINE_WAIT(wait);
+    int ret;
+    
+    for (;;) {
+        ret = stack_pop_batch(s, values, n, bottom, false);
+        if (ret)
+            return ret;
+            
+        // Another consumer beat us to the element that woke us, the
+        // deadline stays fixed across such retries
+        if (woken)
+            this_cpu_inc(stack_stats.spurious_wakeups);
+        if (timeout_ns == 0)
+            return -ETIMEDOUT;
+            
+        // Spin once per call, a consumer that lost the race after spinning
+        // or being woken goes to sleep
+        if (!spun && !woken) {
+            spun = true;
+            if (stack_spin_wait(s, deadline))
+                continue;
+        }
+        
+        // Exclusive, so a push of n elements wakes at most n consumers
+        // instead of all of them
+        prepare_to_wait_exclusive(&s->wait, &wait, TASK_INTERRUPTIBLE);
+        ret = 0;
+        if (!stack_depth_hint(s)) {
+            if (signal_pending(current))
+                ret = -ERESTARTSYS;
+            else if (timeout_ns < 0)
+                schedule();
+            else if (!schedule_hrtimeout(&deadline, HRTIMER_MODE_ABS))
+                ret = -ETIMEDOUT;
+        }
+        // autoremove_wake_function() dequeued us if a push woke us
+        woken = list_empty(&wait.entry);
+        finish_wait(&s->wait, &wait);
+        
+        if (ret) {
+            // Hand a wakeup we are not going to use to the next consumer
+            if (woken && stack_depth_hint(s))
+                wake_up_interruptible(&s->wait);
+            return ret;
+        }
+    }
+}
+
+// Peek without the lock. The end and the element it points at are read
+// optimistically and kept if neither end nor the layout changed in
+// between, so at worst the result is an element that was the next to pop
+// a moment ago. Returns -EAGAIN in heap modes, where the root is only
+// meaningful between sifts and the caller has to take the lock.
+static int stack_peek_lockless(struct stack *s, int *value, bool bottom) {
+    struct stack_buf *buf;
+    unsigned int seq, head, top;
+    int mode, ret;
+    
+    rcu_read_lock();
+    for (;;) {
+        seq = read_seqcount_begin(&s->layout_seq);
+        mode = READ_ONCE(s->mode);
+        if (mode == STACK_MODE_MAX_HEAP || mode == STACK_MODE_MIN_HEAP) {
+            ret = -EAGAIN;
+            break;
+        }
+        
+        // Pairs with the releases in the push paths, the element is
+        // written before the end that covers it moves
+        head = smp_load_acquire(&s->head);
+        top = smp_load_acquire(&s->top);
+        buf = rcu_dereference(s->buf);
+        ret = -ENODATA;
+        if (top != head) {
+            if ((bottom && mode == STACK_MODE_DEQUE) ||
+                mode == STACK_MODE_FIFO || mode == STACK_MODE_FIFO_SPSC)
+                *value = READ_ONCE(buf->data[head & buf->mask]);
+            else
+                *value = READ_ONCE(buf->data[(top - 1) & buf->mask]);
+            ret = 0;
+        }
+        
+        // The read barrier in read_seqcount_retry() also orders the
+        // element before the second look at the ends
+        if (!read_seqcount_retry(&s->layout_seq, seq) &&
+            READ_ONCE(s->head) == head && READ_ONCE(s->top) == top)
+            break;
+    }
+    rcu_read_unlock();
+    
+    return ret;
+}
+
+static int stack_peek(struct stack *s, int *value, bool bottom) {
+    int ret = stack_peek_lockless(s, value, bottom);
+    
+    if (ret != -EAGAIN)
+        return ret;
+        
+    ret = 0;
+retry:
+    stack_lock(s, STACK_OP_QUERY);
+    // A mode switch may still be building the heap between lock breaks
+    if (unlikely(s->spsc == STACK_SPSC_PAUSED)) {
+        stack_unlock(s);
+        stack_spsc_wait(s);
+        goto retry;
+    }
+    // The lock does not stop a lock-free fifo-spsc consumer, the acquire
+    // pairs with stack_spsc_push() so the slot we read has been written
+    if (smp_load_acquire(&s->top) == READ_ONCE(s->head))
+        ret = -ENODATA;
+    else
+        *value = __stack_peek(s, bottom);
+    stack_unlock(s);
+    
+    return ret;
+}
+
+// Switch between stack modes. The contents are kept as they are, except
+// that entering a heap mode reorders them into a heap. Caller is inside a
+// configuration change and holds the lock.
+static void __stack_set_mode(struct stack *s, int mode) {
+    // A lock-free peek that overlaps the switch retries and then sees the
+    // new mode, so heapify can run outside the write section
+    preempt_disable();
+    write_seqcount_begin(&s->layout_seq);
+    WRITE_ONCE(s->mode, mode);
+    write_seqcount_end(&s->layout_seq);
+    preempt_enable();
+    // Every mode switch starts over with unclaimed SPSC ends
+    s->spsc_producer = NULL;
+    s->spsc_consumer = NULL;
+    s->spsc_shared = false;
+    if (stack_is_heap(s)) {
+        stack_pause(s);
+        stack_heapify_long(s);
+    }
+}
+
+static int stack_set_mode(struct stack *s, int mode) {
+    if (mode < 0 || mode >= ARRAY_SIZE(stack_mode_names))
+        return -EINVAL;
+        
+    stack_config_begin(s);
+    stack_lock(s, STACK_OP_OTHER);
+    __stack_set_mode(s, mode);
+    stack_unlock(s);
+    stack_config_end(s);
+    
+    return 0;
+}
+
+// Aggregate kernels over a contiguous range. Four independent
+// accumulators keep the loops free of loop-carried dependencies so the
+// CPU can overlap the loads.
+static s64 stack_range_sum(const int *p, unsigned int n) {
+    s64 s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    unsigned int i;
+    
+    for (i = 0; i + 4 <= n; i += 4) {
+        s0 += p[i];
+        s1 += p[i + 1];
+        s2 += p[i + 2];
+        s3 += p[i + 3];
+    }
+    for (; i < n; i++)
+        s0 += p[i];
+        
+    return s0 + s1 + s2 + s3;
+}
+
+static int stack_range_min(const int *p, unsigned int n, int m0) {
+    int m1 = m0, m2 = m0, m3 = m0;
+    unsigned int i;
+    
+    for (i = 0; i + 4 <= n; i += 4) {
+        m0 = min(m0, p[i]);
+        m1 = min(m1, p[i + 1]);
+        m2 = min(m2, p[i + 2]);
+        m3 = min(m3, p[i + 3]);
+    }
+    for (; i < n; i++)
+        m0 = min(m0, p[i]);
+        
+    return min(min(m0, m1), min(m2, m3));
+}
+
+static int stack_range_max(const int *p, unsigned int n, int m0) {
+    int m1 = m0, m2 = m0, m3 = m0;
+    unsigned int i;
+    
+    for (i = 0; i + 4 <= n; i += 4) {
+        m0 = max(m0, p[i]);
+        m1 = max(m1, p[i + 1]);
+        m2 = max(m2, p[i + 2]);
+        m3 = max(m3, p[i + 3]);
+    }
+    for (; i < n; i++)
+        m0 = max(m0, p[i]);
+        
+    return max(max(m0, m1), max(m2, m3));
+}
+
+static u64 stack_range_count(const int *p, unsigned int n, int value) {
+    u64 c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+    unsigned int i;
+    
+    for (i = 0; i + 4 <= n; i += 4) {
+        c0 += p[i] == value;
+        c1 += p[i + 1] == value;
+        c2 += p[i + 2] == value;
+        c3 += p[i + 3] == value;
+    }
+    for (; i < n; i++)
+        c0 += p[i] == value;
+        
+    return c0 + c1 + c2 + c3;
+}
+
+// Compute SUM/MIN/MAX/COUNT_VALUE over the live elements in place.
+// The lock is held for the whole scan so the result matches one state of
+// the stack; MIN and MAX of an empty stack return -ENODATA.
+static int stack_aggregate(struct stack *s, unsigned int cmd, int value, s64 *result) {
+    unsigned int pos, n, slot, len;
+    const int *p;
+    s64 acc;
+    int ret = 0;
+    
+    // Pause fifo-spsc producers and consumers for a stable view, and with
+    // a spinning lock the locked ones too so the scan can break the lock
+    stack_config_begin(s);
+    stack_lock(s, STACK_OP_QUERY);
+    stack_pause(s);
+    
+    n = stack_depth(s);
+    switch (cmd) {
+    case IOCTL_GET_MIN:
+        acc = INT_MAX;
+        break;
+    case IOCTL_GET_MAX:
+        acc = INT_MIN;
+        break;
+    default:
+        acc = 0;
+        break;
+    }
+    
+    if (!n && (cmd == IOCTL_GET_MIN || cmd == IOCTL_GET_MAX))
+        ret = -ENODATA;
+        
+    // Walk the ring as contiguous blocks, at most two per wrap
+    for (pos = s->head; n; pos += len, n -= len) {
+        slot = pos & s->mask;
+        len = min(min(n, s->mask + 1 - slot), (unsigned int)STACK_SCAN_BLOCK);
+        p = s->data + slot;
+        
+        switch (cmd) {
+        case IOCTL_GET_SUM:
+            acc += stack_range_sum(p, len);
+            break;
+        case IOCTL_GET_MIN:
+            acc = stack_range_min(p, len, acc);
+            break;
+        case IOCTL_GET_MAX:
+            acc = stack_range_max(p, len, acc);
+            break;
+        case IOCTL_COUNT_VALUE:
+            acc += stack_range_count(p, len, value);
+            break;
+        }
+        
+        stack_lock_break(s, STACK_OP_QUERY);
+    }
+    
+    stack_unlock(s);
+    stack_config_end(s);
+    
+    *result = acc;
+    return ret;
+}
+
+// Aggregate ioctls: SUM and COUNT_VALUE return a long long, COUNT_VALUE
+// also takes the value to count in it; MIN and MAX return an int
+static long stack_ioctl_aggregate(unsigned int cmd, unsigned long arg) {
+    long long value = 0;
+    s64 result;
+    int ret;
+    
+    if (cmd == IOCTL_COUNT_VALUE) {
+        if (copy_from_user(&value, (long long __user *)arg, sizeof(value)))
+            return -EFAULT;
+        if (value < INT_MIN || value > INT_MAX)
+            return -EINVAL;
+    }
+    
+    ret = stack_aggregate(stack, cmd, value, &result);
+    if (ret)
+        return ret;
+        
+    if (cmd == IOCTL_GET_MIN || cmd == IOCTL_GET_MAX) {
+        int r = result;
+        
+        if (copy_to_user((int __user *)arg, &r, sizeof(r)))
+            return -EFAULT;
+        return 0;
+    }
+    
+    value = result;
+    if (copy_to_user((long long __user *)arg, &value, sizeof(value)))
+        return -EFAULT;
+    return 0;
+}
+
+// Whether this file operates on the bottom end for the given direction.
+// Only a hint taken without the lock, the locked paths check the mode again.
+static bool stack_file_bottom(struct file *file, unsigned int end) {
+    struct stack_file *sf = file->private_data;
+    
+    return (sf->ends & end) && READ_ONCE(stack->mode) == STACK_MODE_DEQUE;
+}
+
+// Push value onto the stack, returns -ERANGE when the stack is full
+int int_stack_push(int value) {
+    return stack_push(stack, value, false);
+}
+EXPORT_SYMBOL_GPL(int_stack_push);
+
+// Pop value from the stack, returns -ENODATA when the stack is empty
+int int_stack_pop(int *value) {
+    return stack_pop(stack, value, false);
+}
+EXPORT_SYMBOL_GPL(int_stack_pop);
 
-// Initialize device on open
-static int stack_open(struct inode *inode, struct file *file) {
-    return 0;
+// Pop a batch of values into buf, in chunks of up to a page. With nowait
+// nothing sleeps but the user copy, see stack_pop_batch().
+static ssize_t stack_read_batch(struct file *file, char __user *buf, size_t count, bool nowait) {
+    bool bottom = stack_file_bottom(file, STACK_POP_BOTTOM);
+    size_t done = 0, chunk;
+    int *values;
+    int ret;
+    
+    values = kmalloc(min_t(size_t, count, PAGE_SIZE), nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!values)
+        return nowait ? -EAGAIN : -ENOMEM;
+        
+    while (done < count) {
+        chunk = min_t(size_t, count - done, PAGE_SIZE);
+        ret = stack_pop_batch(stack, values, chunk / sizeof(int), bottom, nowait);
+        if (ret < 0) {
+            kfree(values);
+            return done ? done : ret;
+        }
+        if (copy_to_user(buf + done, values, ret * sizeof(int))) {
+            kfree(values);
+            return -EFAULT;
+        }
+        done += ret * sizeof(int);
+        if (ret * sizeof(int) < chunk)
+            break;
+    }
+    
+    kfree(values);
+    return done;
 }
 
-// Cleanup on device close
-static int stack_release(struct inode *inode, struct file *file) {
-    return 0;
+// Push a batch of values from buf, in chunks of up to a page. With nowait
+// nothing sleeps but the user copy, see stack_push_batch().
+static ssize_t stack_write_batch(struct file *file, const char __user *buf, size_t count, bool nowait) {
+    bool bottom = stack_file_bottom(file, STACK_PUSH_BOTTOM);
+    size_t done = 0, chunk;
+    int *values;
+    int ret = 0;
+    
+    values = kmalloc(min_t(size_t, count, PAGE_SIZE), nowait ? GFP_NOWAIT : GFP_KERNEL);
+    if (!values)
+        return nowait ? -EAGAIN : -ENOMEM;
+        
+    while (done < count) {
+        chunk = min_t(size_t, count - done, PAGE_SIZE);
+        if (copy_from_user(values, buf + done, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = stack_push_batch(stack, values, chunk / sizeof(int), bottom, nowait);
+        if (ret < 0)
+            break;
+        done += ret * sizeof(int);
+        if (ret * sizeof(int) < chunk)
+            break;
+    }
+    
+    kfree(values);
+    return done ? done : ret;
 }
 
-// Pop operation - returns value from top of stack
+// Pop operation - returns value from top of stack.
+// Reading several ints pops up to that many in one call.
 static ssize_t stack_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
     int value;
     
-    if (count != sizeof(int))
+    if (count == 0 || count % sizeof(int))
         return -EINVAL;
         
-    mutex_lock(&stack->lock);
-    
-    if (stack->top == 0) {
-        mutex_unlock(&stack->lock);
+    if (count > sizeof(int))
+        return stack_read_batch(file, buf, count, false);
+        
+    if (stack_pop(stack, &value, stack_file_bottom(file, STACK_POP_BOTTOM)))
         return 0; // Return NULL for empty stack
-    }
-    
-    value = stack->data[--stack->top];
-    mutex_unlock(&stack->lock);
     
     if (copy_to_user(buf, &value, sizeof(int)))
         return -EFAULT;
@@ -59,67 +1982,377 @@ static ssize_t stack_read(struct file *file, char __user *buf, size_t count, lof
     return sizeof(int);
 }
 
-// Push operation - adds value to stack
+// Pop into an iov_iter for readv() and, through copy_splice_read(), for
+// splice() and sendfile(), so draining into a pipe or file skips the
+// userspace buffer
+static ssize_t stack_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    bool bottom = stack_file_bottom(iocb->ki_filp, STACK_POP_BOTTOM);
+    size_t count = iov_iter_count(to);
+    size_t done = 0, chunk;
+    int *values;
+    int ret;
+    
+    if (count == 0 || count % sizeof(int))
+        return -EINVAL;
+        
+    values = kmalloc(min_t(size_t, count, PAGE_SIZE), GFP_KERNEL);
+    if (!values)
+        return -ENOMEM;
+        
+    while (done < count) {
+        chunk = min_t(size_t, count - done, PAGE_SIZE);
+        ret = stack_pop_batch(stack, values, chunk / sizeof(int), bottom, false);
+        if (copy_to_iter(values, ret * sizeof(int), to) != ret * sizeof(int)) {
+            ret = -EFAULT;
+            break;
+        }
+        done += ret * sizeof(int);
+        if (ret * sizeof(int) < chunk)
+            break;
+    }
+    
+    kfree(values);
+    return done ? done : ret;
+}
+
+// Push operation - adds value to stack.
+// Writing several ints pushes as many of them as fit in one call.
 static ssize_t stack_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
     int value;
+    int ret;
     
-    if (count != sizeof(int))
+    if (count == 0 || count % sizeof(int))
         return -EINVAL;
         
+    if (count > sizeof(int))
+        return stack_write_batch(file, buf, count, false);
+        
     if (copy_from_user(&value, buf, sizeof(int)))
         return -EFAULT;
         
-    mutex_lock(&stack->lock);
+    ret = stack_push(stack, value, stack_file_bottom(file, STACK_PUSH_BOTTOM));
+    if (ret)
+        return ret;
     
-    if (stack->top >= stack->size) {
-        mutex_unlock(&stack->lock);
-        return -ERANGE;
+    return sizeof(int);
+}
+
+// Push from an iov_iter for writev() and, through iter_file_splice_write(),
+// for splice() from a pipe
+static ssize_t stack_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    bool bottom = stack_file_bottom(iocb->ki_filp, STACK_PUSH_BOTTOM);
+    size_t count = iov_iter_count(from);
+    size_t done = 0, chunk;
+    int *values;
+    int ret = 0;
+    
+    if (count == 0 || count % sizeof(int))
+        return -EINVAL;
+        
+    values = kmalloc(min_t(size_t, count, PAGE_SIZE), GFP_KERNEL);
+    if (!values)
+        return -ENOMEM;
+        
+    while (done < count) {
+        chunk = min_t(size_t, count - done, PAGE_SIZE);
+        if (copy_from_iter(values, chunk, from) != chunk) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = stack_push_batch(stack, values, chunk / sizeof(int), bottom, false);
+        if (ret < 0) {
+            iov_iter_revert(from, chunk);
+            break;
+        }
+        done += ret * sizeof(int);
+        if (ret * sizeof(int) < chunk) {
+            // Leave what did not fit unconsumed, e.g. in the pipe
+            iov_iter_revert(from, chunk - ret * sizeof(int));
+            break;
+        }
     }
     
-    stack->data[stack->top++] = value;
-    mutex_unlock(&stack->lock);
+    kfree(values);
+    return done ? done : ret;
+}
+
+// Take a queued pop back off the waiter list. Returns false if a push got
+// there first, the command then belongs to the task work it was handed to
+// and may already be completed, so only its address is compared.
+static bool stack_uring_unqueue(struct stack *s, struct stack_uring_pdu *pdu) {
+    struct stack_uring_pdu *pos;
+    bool queued = false;
+    
+    spin_lock(&s->uring_lock);
+    list_for_each_entry(pos, &s->uring_waiters, node) {
+        if (pos == pdu) {
+            list_del_init(&pos->node);
+            queued = true;
+            break;
+        }
+    }
+    spin_unlock(&s->uring_lock);
     
-    return sizeof(int);
+    return queued;
 }
 
-// Configure stack size via ioctl
-static long stack_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
-    int new_size;
-    int *new_data;
+// Pop for a STACK_CMD_POP, queueing the command while the stack is empty.
+// The command is completed through io_uring_cmd_done(), here or by task
+// work after a push, so this returns -EIOCBQUEUED. A nonblocking issue
+// that would have to sleep returns -EAGAIN before the command is queued.
+static int stack_uring_pop(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    struct stack_uring_pdu *pdu = stack_uring_pdu(ioucmd);
+    bool nowait = issue_flags & IO_URING_F_NONBLOCK;
+    ssize_t ret;
     
-    if (cmd != IOCTL_SET_SIZE)
-        return -ENOTTY;
+    // Before the command is published: a push on another CPU may complete
+    // it as soon as it is on the waiter list, e.g. while an io-wq worker
+    // is still issuing it
+    io_uring_cmd_mark_cancelable(ioucmd, issue_flags);
+    
+    for (;;) {
+        ret = stack_read_batch(ioucmd->file, u64_to_user_ptr(pdu->addr), pdu->count * sizeof(int), nowait);
+        if (ret == -EAGAIN)
+            return ret;
+        if (ret) {
+            stack_uring_done(ioucmd, ret < 0 ? ret : ret / sizeof(int), issue_flags);
+            return -EIOCBQUEUED;
+        }
         
-    if (copy_from_user(&new_size, (int __user *)arg, sizeof(int)))
-        return -EFAULT;
+        spin_lock(&stack->uring_lock);
+        list_add_tail(&pdu->node, &stack->uring_waiters);
+        spin_unlock(&stack->uring_lock);
         
-    if (new_size <= 0)
-        return -EINVAL;
+        // From here on the command is only ours again if we unqueue it.
+        // Pairs with the barrier in stack_push_batch().
+        smp_mb();
+        if (!stack_depth_hint(stack))
+            return -EIOCBQUEUED;
+            
+        // A push raced with us, take the command back unless that push
+        // already handed it to task work
+        if (!stack_uring_unqueue(stack, pdu))
+            return -EIOCBQUEUED;
+    }
+}
+
+// Retry a queued pop after a push. When the submitting task is exiting
+// this runs from io_uring's fallback kworker, which has no user mm to copy
+// into, so the pop is cancelled rather than losing the elements.
+static void __stack_uring_pop_task(struct io_uring_cmd *ioucmd, unsigned int issue_flags, bool dead) {
+    if (dead) {
+        stack_uring_done(ioucmd, -ECANCELED, issue_flags);
+        return;
+    }
+    stack_uring_pop(ioucmd, issue_flags);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+static void stack_uring_pop_task(struct io_uring_cmd *ioucmd, io_tw_token_t tw) {
+    __stack_uring_pop_task(ioucmd, IO_URING_CMD_TASK_WORK_ISSUE_FLAGS, tw.cancel);
+}
+#else
+static void stack_uring_pop_task(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    __stack_uring_pop_task(ioucmd, issue_flags, issue_flags & IO_URING_F_TASK_DEAD);
+}
+#endif
+
+// The ring is going away: fail a queued pop unless a push already claimed it
+static void stack_uring_cancel(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    if (stack_uring_unqueue(stack, stack_uring_pdu(ioucmd)))
+        stack_uring_done(ioucmd, -ECANCELED, issue_flags);
+}
+
+// IORING_OP_URING_CMD entry point. The CQE result is 0 or the number of
+// elements moved, or a negative errno. Pops on an empty stack complete
+// asynchronously once a push arrives instead of blocking the ring.
+static int stack_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    const struct stack_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    struct stack_uring_pdu *pdu = stack_uring_pdu(ioucmd);
+    void __user *addr = u64_to_user_ptr(READ_ONCE(cmd->addr));
+    u32 count = READ_ONCE(cmd->count);
+    bool nowait = issue_flags & IO_URING_F_NONBLOCK;
+    ssize_t ret;
+    int value;
+    
+    BUILD_BUG_ON(sizeof(struct stack_uring_pdu) > sizeof_field(struct io_uring_cmd, pdu));
+    
+    if (issue_flags & IO_URING_F_CANCEL) {
+        stack_uring_cancel(ioucmd, issue_flags);
+        return 0;
+    }
+    
+    // An inline issue must not sleep in the submitter, anything that would
+    // returns -EAGAIN and io_uring issues it again from io-wq. Batches over
+    // a page take the lock once per chunk and could stop halfway, so they
+    // always go there.
+    switch (ioucmd->cmd_op) {
+    case STACK_CMD_PUSH:
+        value = READ_ONCE(cmd->value);
+        ret = stack_push_batch(stack, &value, 1, stack_file_bottom(ioucmd->file, STACK_PUSH_BOTTOM), nowait);
+        return ret < 0 ? ret : 0;
+        
+    case STACK_CMD_PUSH_BATCH:
+        if (count == 0 || count > INT_MAX / sizeof(int))
+            return -EINVAL;
+        if (nowait && count > PAGE_SIZE / sizeof(int))
+            return -EAGAIN;
+        ret = stack_write_batch(ioucmd->file, addr, count * sizeof(int), nowait);
+        return ret < 0 ? ret : ret / sizeof(int);
+        
+    case STACK_CMD_POP:
+        if (count == 0 || count > INT_MAX / sizeof(int))
+            return -EINVAL;
+        if (nowait && count > PAGE_SIZE / sizeof(int))
+            return -EAGAIN;
+        INIT_LIST_HEAD(&pdu->node);
+        pdu->addr = (u64)(uintptr_t)addr;
+        pdu->count = count;
+        return stack_uring_pop(ioucmd, issue_flags);
         
-    mutex_lock(&stack->lock);
+    case STACK_CMD_PEEK:
+        // Only heap modes need the lock
+        if (nowait)
+            ret = stack_peek_lockless(stack, &value, stack_file_bottom(ioucmd->file, STACK_POP_BOTTOM));
+        else
+            ret = stack_peek(stack, &value, stack_file_bottom(ioucmd->file, STACK_POP_BOTTOM));
+        if (ret)
+            return ret;
+        return put_user(value, (int __user *)addr);
+    }
+    
+    return -ENOTTY;
+}
+
+static long stack_ioctl_pop_timeout(struct file *file, unsigned int cmd, unsigned long arg) {
+    bool bottom = stack_file_bottom(file, STACK_POP_BOTTOM);
+    struct stack_pop_timeout req;
+    struct stack_pop_batch batch;
+    int *values;
+    int n, ret;
     
-    // Allocate new memory for the stack
-    new_data = kmalloc(new_size * sizeof(int), GFP_KERNEL);
-    if (!new_data) {
-        mutex_unlock(&stack->lock);
+    if (cmd == IOCTL_POP_TIMEOUT) {
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        ret = stack_pop_timeout(stack, &req.value, 1, bottom, req.timeout_ns);
+        if (ret < 0)
+            return ret;
+        if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+            return -EFAULT;
+        return 0;
+    }
+    
+    if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count == 0)
+        return -EINVAL;
+        
+    // At most a page worth per call, like the other batch paths
+    n = min_t(u32, batch.count, PAGE_SIZE / sizeof(int));
+    values = kmalloc_array(n, sizeof(int), GFP_KERNEL);
+    if (!values)
         return -ENOMEM;
+        
+    ret = stack_pop_timeout(stack, values, n, bottom, batch.timeout_ns);
+    if (ret > 0) {
+        batch.popped = ret;
+        if (copy_to_user(u64_to_user_ptr(batch.addr), values, ret * sizeof(int)) ||
+            copy_to_user((void __user *)arg, &batch, sizeof(batch)))
+            ret = -EFAULT;
+    }
+    
+    kfree(values);
+    return ret < 0 ? ret : 0;
+}
+
+// Queries for monitoring, which poll often and never take the stack lock
+// except for peeking in heap modes
+static long stack_ioctl_query(struct file *file, unsigned int cmd, unsigned long arg) {
+    int value, ret;
+    
+    switch (cmd) {
+    case IOCTL_GET_DEPTH:
+        value = stack_depth_hint(stack);
+        break;
+    case IOCTL_GET_SIZE:
+        value = READ_ONCE(stack->size);
+        break;
+    default:
+        ret = stack_peek(stack, &value, stack_file_bottom(file, STACK_POP_BOTTOM));
+        if (ret)
+            return ret;
+        break;
     }
     
-    // Copy existing elements to the new stack
-    if (stack->data) {
-        int elements_to_copy = (stack->top < new_size) ? stack->top : new_size;
-        memcpy(new_data, stack->data, elements_to_copy * sizeof(int));
-        kfree(stack->data);
+    return put_user(value, (int __user *)arg);
+}
+
+// Configure the stack via ioctl
+static long stack_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct stack_file *sf = file->private_data;
+    int value;
+    
+    switch (cmd) {
+    case IOCTL_SET_SIZE:
+    case IOCTL_SET_MODE:
+    case IOCTL_SET_ENDS:
+    case IOCTL_SET_EVENTFD:
+    case IOCTL_SET_NOTIFY_HIGH:
+    case IOCTL_SET_NOTIFY_LOW:
+        if (copy_from_user(&value, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        break;
+    case IOCTL_GET_SUM:
+    case IOCTL_GET_MIN:
+    case IOCTL_GET_MAX:
+    case IOCTL_COUNT_VALUE:
+        return stack_ioctl_aggregate(cmd, arg);
+    case IOCTL_POP_TIMEOUT:
+    case IOCTL_POP_TIMEOUT_BATCH:
+        return stack_ioctl_pop_timeout(file, cmd, arg);
+    case IOCTL_GET_DEPTH:
+    case IOCTL_GET_SIZE:
+    case IOCTL_PEEK:
+        return stack_ioctl_query(file, cmd, arg);
+    default:
+        return -ENOTTY;
     }
     
-    stack->data = new_data;
-    stack->size = new_size;
-    if (stack->top > new_size) {
-        stack->top = new_size; // Adjust top if new size is smaller
+    switch (cmd) {
+    case IOCTL_SET_SIZE:
+        if (value <= 0)
+            return -EINVAL;
+        return stack_resize(stack, value);
+        
+    case IOCTL_SET_MODE:
+        return stack_set_mode(stack, value);
+        
+    case IOCTL_SET_ENDS:
+        // Bottom operations only make sense on a deque
+        if (value & ~(STACK_PUSH_BOTTOM | STACK_POP_BOTTOM))
+            return -EINVAL;
+        if (value && READ_ONCE(stack->mode) != STACK_MODE_DEQUE)
+            return -EINVAL;
+        sf->ends = value;
+        return 0;
+        
+    case IOCTL_SET_EVENTFD:
+        return stack_set_eventfd(stack, value);
+        
+    case IOCTL_SET_NOTIFY_HIGH:
+        if (value < 0)
+            return -EINVAL;
+        WRITE_ONCE(stack->notify_high, value);
+        return 0;
+        
+    case IOCTL_SET_NOTIFY_LOW:
+        if (value < -1)
+            return -EINVAL;
+        WRITE_ONCE(stack->notify_low, value);
+        return 0;
     }
-    mutex_unlock(&stack->lock);
     
-    return 0;
+    return -ENOTTY;
 }
 
 // File operations structure
@@ -128,20 +2361,597 @@ static const struct file_operations stack_fops = {
     .open = stack_open,
     .release = stack_release,
     .read = stack_read,
+    .read_iter = stack_read_iter,
+    .splice_read = copy_splice_read,
     .write = stack_write,
+    .write_iter = stack_write_iter,
+    .splice_write = iter_file_splice_write,
+    .uring_cmd = stack_uring_cmd,
+    .fasync = stack_fasync,
     .unlocked_ioctl = stack_ioctl,
 };
 
+// Pin the current contents of s for streaming by stack_snapshot_copy()
+static struct stack_snapshot *stack_snapshot_create(struct stack *s) {
+    struct stack_snapshot *snap;
+    
+    // Pushes preserve blocks for open snapshots under the stack lock, with
+    // a spinlock_t and GFP_NOWAIT allocations. Neither is allowed inside a
+    // raw spinlock, which stays non-preemptible even on PREEMPT_RT.
+    if (s->lock_type == STACK_LOCK_RAW_SPINLOCK)
+        return ERR_PTR(-EOPNOTSUPP);
+        
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return ERR_PTR(-ENOMEM);
+    spin_lock_init(&snap->lock);
+    
+    // The configuration lock keeps the ring geometry stable and pauses
+    // lock-free operations, which do not preserve blocks
+    stack_config_begin(s);
+    snap->mask = s->mask;
+    snap->block = min_t(unsigned int, STACK_SNAPSHOT_BLOCK, s->mask + 1);
+    snap->blocks = kvcalloc((s->mask + 1) / snap->block, sizeof(int *), GFP_KERNEL);
+    if (!snap->blocks) {
+        stack_config_end(s);
+        kfree(snap);
+        return ERR_PTR(-ENOMEM);
+    }
+    
+    stack_lock(s, STACK_OP_OTHER);
+    snap->buf = rcu_dereference_protected(s->buf, true);
+    if (snap->buf)
+        kref_get(&snap->buf->ref);
+    snap->cursor = s->head;
+    snap->top = s->top;
+    snap->mode = s->mode;
+    snap->size = s->size;
+    list_add(&snap->node, &s->snapshots);
+    stack_unlock(s);
+    stack_config_end(s);
+    
+    return snap;
+}
+
+static void stack_snapshot_destroy(struct stack *s, struct stack_snapshot *snap) {
+    unsigned int b;
+    
+    stack_config_begin(s);
+    stack_lock(s, STACK_OP_OTHER);
+    list_del(&snap->node);
+    stack_unlock(s);
+    stack_config_end(s);
+    
+    for (b = 0; b < (snap->mask + 1) / snap->block; b++)
+        kfree(snap->blocks[b]);
+    kvfree(snap->blocks);
+    stack_buf_put(snap->buf);
+    kfree(snap);
+}
+
+// Stream the pinned contents bottom to top. Each block is taken from its
+// preserved copy if a writer got there first, or else straight from the
+// ring, so the stack lock is never taken.
+static ssize_t stack_snapshot_copy(struct stack_snapshot *snap, char __user *buf, size_t count) {
+    unsigned int chunk, fill, n, slot, b;
+    size_t done = 0;
+    ssize_t ret = 0;
+    const int *src;
+    int *values;
+    
+    if (count % sizeof(int))
+        return -EINVAL;
+        
+    if (count == 0)
+        return 0;
+        
+    values = kvmalloc(min_t(size_t, count, STACK_SNAPSHOT_CHUNK), GFP_KERNEL);
+    if (!values)
+        return -ENOMEM;
+        
+    while (done < count) {
+        chunk = min_t(size_t, count - done, STACK_SNAPSHOT_CHUNK) / sizeof(int);
+        
+        for (fill = 0; fill < chunk; fill += n) {
+            spin_lock(&snap->lock);
+            if (snap->broken) {
+                spin_unlock(&snap->lock);
+                ret = -ENOMEM;
+                break;
+            }
+            
+            slot = snap->cursor & snap->mask;
+            b = slot / snap->block;
+            n = min3(chunk - fill, snap->top - snap->cursor, snap->block - slot % snap->block);
+            if (!n) {
+                spin_unlock(&snap->lock);
+                break;
+            }
+            
+            src = snap->blocks[b] ? snap->blocks[b] + slot % snap->block : snap->buf->data + slot;
+            memcpy(values + fill, src, n * sizeof(int));
+            snap->cursor += n;
+            
+            if (snap->blocks[b] && !stack_snapshot_pending(snap, b)) {
+                kfree(snap->blocks[b]);
+                snap->blocks[b] = NULL;
+            }
+            spin_unlock(&snap->lock);
+        }
+        
+        if (copy_to_user(buf + done, values, fill * sizeof(int))) {
+            ret = -EFAULT;
+            break;
+        }
+        done += fill * sizeof(int);
+        if (ret || fill < chunk)
+            break;
+    }
+    
+    kvfree(values);
+    return done ? done : ret;
+}
+
+static int stack_snapshot_open(struct inode *inode, struct file *file) {
+    struct stack_snapshot *snap = stack_snapshot_create(stack);
+    
+    if (IS_ERR(snap))
+        return PTR_ERR(snap);
+        
+    file->private_data = snap;
+    return stream_open(inode, file);
+}
+
+static int stack_snapshot_release(struct inode *inode, struct file *file) {
+    stack_snapshot_destroy(stack, file->private_data);
+    return 0;
+}
+
+static ssize_t stack_snapshot_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    return stack_snapshot_copy(file->private_data, buf, count);
+}
+
+// File operations of the snapshot node, installed by stack_open()
+static const struct file_operations stack_snapshot_fops = {
+    .owner = THIS_MODULE,
+    .open = stack_snapshot_open,
+    .release = stack_snapshot_release,
+    .read = stack_snapshot_read,
+};
+
+// Print counters summed over all CPUs, followed by the per-CPU breakdown
+static int stack_stats_show(struct seq_file *m, void *v) {
+    struct stack_stats sum = {};
+    unsigned int cpu;
+    
+    for_each_possible_cpu(cpu) {
+        struct stack_stats *st = per_cpu_ptr(&stack_stats, cpu);
+        
+        sum.pushes += st->pushes;
+        sum.pops += st->pops;
+        sum.empty_pops += st->empty_pops;
+        sum.full_pushes += st->full_pushes;
+        sum.overwrites += st->overwrites;
+        sum.resizes += st->resizes;
+        sum.bytes_copied += st->bytes_copied;
+        sum.contended += st->contended;
+        sum.spurious_wakeups += st->spurious_wakeups;
+        sum.spin_hits += st->spin_hits;
+        sum.spin_misses += st->spin_misses;
+        sum.combined += st->combined;
+    }
+    
+    seq_printf(m, "pushes: %llu\n", sum.pushes);
+    seq_printf(m, "pops: %llu\n", sum.pops);
+    seq_printf(m, "empty_pops: %llu\n", sum.empty_pops);
+    seq_printf(m, "full_pushes: %llu\n", sum.full_pushes);
+    seq_printf(m, "overwrites: %llu\n", sum.overwrites);
+    seq_printf(m, "resizes: %llu\n", sum.resizes);
+    seq_printf(m, "bytes_copied: %llu\n", sum.bytes_copied);
+    seq_printf(m, "contended: %llu\n", sum.contended);
+    seq_printf(m, "spurious_wakeups: %llu\n", sum.spurious_wakeups);
+    seq_printf(m, "spin_hits: %llu\n", sum.spin_hits);
+    seq_printf(m, "spin_misses: %llu\n", sum.spin_misses);
+    seq_printf(m, "combined: %llu\n", sum.combined);
+    seq_printf(m, "push_gap_ns: %llu\n", READ_ONCE(stack->push_gap_ns));
+    seq_printf(m, "high_watermark: %d\n", READ_ONCE(stack->high_watermark));
+    
+    seq_puts(m, "\ncpu pushes pops empty_pops full_pushes overwrites resizes bytes_copied contended spurious_wakeups spin_hits spin_misses combined\n");
+    for_each_possible_cpu(cpu) {
+        struct stack_stats *st = per_cpu_ptr(&stack_stats, cpu);
+        
+        if (!st->pushes && !st->pops && !st->empty_pops && !st->full_pushes &&
+            !st->overwrites && !st->resizes && !st->contended && !st->spurious_wakeups &&
+            !st->spin_hits && !st->spin_misses && !st->combined)
+            continue;
+        seq_printf(m, "%u %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n", cpu,
+                   st->pushes, st->pops, st->empty_pops, st->full_pushes,
+                   st->overwrites, st->resizes, st->bytes_copied, st->contended,
+                   st->spurious_wakeups, st->spin_hits, st->spin_misses, st->combined);
+    }
+    
+    return 0;
+}
+
+static int stack_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, stack_stats_show, NULL);
+}
+
+// Writing anything to the stats file resets the counters and the high-water mark.
+// Increments racing with the reset on other CPUs may survive it.
+static ssize_t stack_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    unsigned int cpu;
+    
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(&stack_stats, cpu), 0, sizeof(struct stack_stats));
+        
+    stack_lock(stack, STACK_OP_OTHER);
+    stack->high_watermark = stack_depth(stack);
+    stack_unlock(stack);
+    
+    return count;
+}
+
+static const struct file_operations stack_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = stack_stats_open,
+    .read = seq_read,
+    .write = stack_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Print non-empty lock wait/hold histogram buckets per operation type
+static int stack_lock_hist_show(struct seq_file *m, void *v) {
+    u64 wait[STACK_HIST_BUCKETS], hold[STACK_HIST_BUCKETS];
+    unsigned int cpu, op, b;
+    
+    seq_printf(m, "lock_timing: %s\n",
+               static_key_enabled(&stack_lock_timing) ? "on" : "off");
+               
+    for (op = 0; op < STACK_OP_COUNT; op++) {
+        memset(wait, 0, sizeof(wait));
+        memset(hold, 0, sizeof(hold));
+        for_each_possible_cpu(cpu) {
+            struct stack_lock_hist *h = per_cpu_ptr(&stack_lock_hist, cpu);
+            
+            for (b = 0; b < STACK_HIST_BUCKETS; b++) {
+                wait[b] += h->wait[op][b];
+                hold[b] += h->hold[op][b];
+            }
+        }
+        
+        seq_printf(m, "\n%s: ns wait hold\n", stack_op_names[op]);
+        for (b = 0; b < STACK_HIST_BUCKETS; b++) {
+            if (!wait[b] && !hold[b])
+                continue;
+            seq_printf(m, "<%llu %llu %llu\n", 1ULL << b, wait[b], hold[b]);
+        }
+    }
+    
+    return 0;
+}
+
+static int stack_lock_hist_open(struct inode *inode, struct file *file) {
+    return single_open(file, stack_lock_hist_show, NULL);
+}
+
+// Writing 1/0 enables or disables lock timing, anything else clears the histograms
+static ssize_t stack_lock_hist_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    unsigned int cpu;
+    bool enable;
+    
+    if (kstrtobool_from_user(buf, count, &enable)) {
+        for_each_possible_cpu(cpu)
+            memset(per_cpu_ptr(&stack_lock_hist, cpu), 0, sizeof(struct stack_lock_hist));
+        return count;
+    }
+    
+    if (enable) {
+        // Forget a start time left behind by a holder timed in an earlier
+        // session, so the first timed unlock cannot pick it up
+        stack_lock(stack, STACK_OP_OTHER);
+        stack->lock_acquired = 0;
+        stack_unlock(stack);
+        static_branch_enable(&stack_lock_timing);
+    } else {
+        static_branch_disable(&stack_lock_timing);
+    }
+    
+    return count;
+}
+
+static const struct file_operations stack_lock_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = stack_lock_hist_open,
+    .read = seq_read,
+    .write = stack_lock_hist_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Opening the image for reading pins a snapshot, opening it for writing
+// starts a restore. Both at once makes no sense.
+static int stack_image_open(struct inode *inode, struct file *file) {
+    struct stack_image *img;
+    
+    if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE))
+        return -EINVAL;
+        
+    img = kzalloc(sizeof(*img), GFP_KERNEL);
+    if (!img)
+        return -ENOMEM;
+        
+    if (file->f_mode & FMODE_READ) {
+        img->snap = stack_snapshot_create(stack);
+        if (IS_ERR(img->snap)) {
+            int ret = PTR_ERR(img->snap);
+            
+            kfree(img);
+            return ret;
+        }
+        img->header.magic = STACK_IMAGE_MAGIC;
+        img->header.version = STACK_IMAGE_VERSION;
+        img->header.mode = img->snap->mode;
+        img->header.size = img->snap->size;
+        img->header.depth = img->snap->top - img->snap->cursor;
+    }
+    
+    file->private_data = img;
+    return stream_open(inode, file);
+}
+
+static int stack_image_release(struct inode *inode, struct file *file) {
+    struct stack_image *img = file->private_data;
+    
+    if (img->snap)
+        stack_snapshot_destroy(stack, img->snap);
+    kfree(img);
+    return 0;
+}
+
+// Header first, then the snapshot contents
+static ssize_t stack_image_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    struct stack_image *img = file->private_data;
+    size_t n;
+    
+    if (img->header_pos < sizeof(img->header)) {
+        n = min(count, sizeof(img->header) - img->header_pos);
+        if (copy_to_user(buf, (char *)&img->header + img->header_pos, n))
+            return -EFAULT;
+        img->header_pos += n;
+        return n;
+    }
+    
+    return stack_snapshot_copy(img->snap, buf, count);
+}
+
+// Give an empty stack the capacity and mode recorded in an image header
+static int stack_image_restore(struct stack *s, const struct stack_image_header *h) {
+    int ret = 0;
+    
+    if (h->magic != STACK_IMAGE_MAGIC || h->version != STACK_IMAGE_VERSION)
+        return -EINVAL;
+    if (h->mode >= ARRAY_SIZE(stack_mode_names) || !h->size || h->size > INT_MAX || h->depth > h->size)
+        return -EINVAL;
+        
+    stack_config_begin(s);
+    stack_lock(s, STACK_OP_OTHER);
+    if (stack_depth(s))
+        ret = -EBUSY;
+    stack_unlock(s);
+    
+    if (!ret && s->size != h->size)
+        ret = __stack_resize(s, h->size);
+        
+    // Pushes carry on during the resize, check again in the same locked
+    // section that switches the mode
+    if (!ret) {
+        stack_lock(s, STACK_OP_OTHER);
+        if (stack_depth(s))
+            ret = -EBUSY;
+        else
+            __stack_set_mode(s, h->mode);
+        stack_unlock(s);
+    }
+    stack_config_end(s);
+    
+    return ret;
+}
+
+// Header first, then elements bottom to top. They go through the batched
+// push path, which preserves the order for every mode: a heap image is
+// already heap-ordered, so no element moves.
+static ssize_t stack_image_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    struct stack_image *img = file->private_data;
+    size_t done = 0, chunk;
+    int *values;
+    int ret = 0;
+    
+    if (img->header_pos < sizeof(img->header)) {
+        chunk = min(count, sizeof(img->header) - img->header_pos);
+        if (copy_from_user((char *)&img->header + img->header_pos, buf, chunk))
+            return -EFAULT;
+        if (img->header_pos + chunk == sizeof(img->header)) {
+            ret = stack_image_restore(stack, &img->header);
+            if (ret)
+                return ret;
+        }
+        img->header_pos += chunk;
+        return chunk;
+    }
+    
+    if (count % sizeof(int))
+        return -EINVAL;
+        
+    values = kvmalloc(min_t(size_t, count, STACK_SNAPSHOT_CHUNK), GFP_KERNEL);
+    if (!values)
+        return -ENOMEM;
+        
+    while (done < count) {
+        chunk = min_t(size_t, count - done, STACK_SNAPSHOT_CHUNK);
+        if (copy_from_user(values, buf + done, chunk)) {
+            ret = -EFAULT;
+            break;
+        }
+        ret = stack_push_batch(stack, values, chunk / sizeof(int), false, false);
+        if (ret < 0)
+            break;
+        done += ret * sizeof(int);
+        if (ret * sizeof(int) < chunk)
+            break;
+    }
+    
+    kvfree(values);
+    return done ? done : ret;
+}
+
+static const struct file_operations stack_image_fops = {
+    .owner = THIS_MODULE,
+    .open = stack_image_open,
+    .release = stack_image_release,
+    .read = stack_image_read,
+    .write = stack_image_write,
+};
+
+// Number of elements currently on the stack
+static ssize_t depth_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", stack_depth_hint(stack));
+}
+static DEVICE_ATTR_RO(depth);
+
+// Highest depth seen since load or the last stats reset
+static ssize_t high_watermark_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", READ_ONCE(stack->high_watermark));
+}
+static DEVICE_ATTR_RO(high_watermark);
+
+// Stack capacity, writing resizes the stack like IOCTL_SET_SIZE
+static ssize_t capacity_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", READ_ONCE(stack->size));
+}
+
+static ssize_t capacity_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int new_size;
+    int ret;
+    
+    ret = kstrtoint(buf, 0, &new_size);
+    if (ret)
+        return ret;
+        
+    if (new_size <= 0)
+        return -EINVAL;
+        
+    ret = stack_resize(stack, new_size);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(capacity);
+
+static ssize_t backend_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%s\n", stack_backend_names[READ_ONCE(stack->backend)]);
+}
+
+static ssize_t backend_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int backend = sysfs_match_string(stack_backend_names, buf);
+    
+    if (backend < 0)
+        return backend;
+        
+    WRITE_ONCE(stack->backend, backend);
+    return count;
+}
+static DEVICE_ATTR_RW(backend);
+
+static ssize_t growth_policy_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%s\n", stack_growth_names[READ_ONCE(stack->growth_policy)]);
+}
+
+static ssize_t growth_policy_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int policy = sysfs_match_string(stack_growth_names, buf);
+    
+    if (policy < 0)
+        return policy;
+        
+    WRITE_ONCE(stack->growth_policy, policy);
+    return count;
+}
+static DEVICE_ATTR_RW(growth_policy);
+
+// Stack mode, same values as IOCTL_SET_MODE by name
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%s\n", stack_mode_names[READ_ONCE(stack->mode)]);
+}
+
+static ssize_t mode_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    int mode = sysfs_match_string(stack_mode_names, buf);
+    int ret;
+    
+    if (mode < 0)
+        return mode;
+        
+    ret = stack_set_mode(stack, mode);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(mode);
+
+static struct attribute *stack_attrs[] = {
+    &dev_attr_depth.attr,
+    &dev_attr_high_watermark.attr,
+    &dev_attr_capacity.attr,
+    &dev_attr_backend.attr,
+    &dev_attr_growth_policy.attr,
+    &dev_attr_mode.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(stack);
+
 // Module initialization
 static int __init stack_init(void) {
+    int type = match_string(stack_lock_type_names, ARRAY_SIZE(stack_lock_type_names), lock_type);
+    
+    if (type < 0)
+        return -EINVAL;
+        
     stack = kmalloc(sizeof(struct stack), GFP_KERNEL);
     if (!stack)
         return -ENOMEM;
         
-    mutex_init(&stack->lock);
+    stack->lock_type = type;
+    if (stack->lock_type == STACK_LOCK_SPINLOCK)
+        spin_lock_init(&stack->spin);
+    else if (stack->lock_type == STACK_LOCK_RAW_SPINLOCK)
+        raw_spin_lock_init(&stack->raw_spin);
+    else
+        mutex_init(&stack->lock);
+    mutex_init(&stack->config_lock);
+    seqcount_init(&stack->layout_seq);
+    RCU_INIT_POINTER(stack->buf, NULL);
     stack->data = NULL;
     stack->size = 0;
+    stack->head = 0;
     stack->top = 0;
+    stack->resize_valid = 0;
+    stack->mask = 0;
+    stack->mode = STACK_MODE_LIFO;
+    stack->spsc = STACK_SPSC_OFF;
+    stack->spsc_producer = NULL;
+    stack->spsc_consumer = NULL;
+    stack->spsc_shared = false;
+    stack->high_watermark = 0;
+    stack->lock_acquired = 0;
+    stack->backend = STACK_BACKEND_LOCKED;
+    init_llist_head(&stack->fc_requests);
+    stack->growth_policy = STACK_GROWTH_FIXED;
+    INIT_LIST_HEAD(&stack->snapshots);
+    spin_lock_init(&stack->uring_lock);
+    INIT_LIST_HEAD(&stack->uring_waiters);
+    RCU_INIT_POINTER(stack->eventfd, NULL);
+    stack->notify_high = 0;
+    stack->notify_low = -1;
+    stack->fasync = NULL;
+    init_waitqueue_head(&stack->wait);
+    stack->last_push = 0;
+    stack->push_gap_ns = 0;
     
     major_number = register_chrdev(0, DEVICE_NAME, &stack_fops);
     if (major_number < 0) {
@@ -156,7 +2966,8 @@ static int __init stack_init(void) {
         return PTR_ERR(stack_class);
     }
     
-    stack_device = device_create(stack_class, NULL, MKDEV(major_number, 0), NULL, DEVICE_NAME);
+    stack_device = device_create_with_groups(stack_class, NULL, MKDEV(major_number, 0), NULL,
+                                             stack_groups, DEVICE_NAME);
     if (IS_ERR(stack_device)) {
         class_destroy(stack_class);
         unregister_chrdev(major_number, DEVICE_NAME);
@@ -164,19 +2975,37 @@ static int __init stack_init(void) {
         return PTR_ERR(stack_device);
     }
     
+    stack_snapshot_device = device_create(stack_class, NULL, MKDEV(major_number, STACK_SNAPSHOT_MINOR),
+                                          NULL, DEVICE_NAME "_snapshot");
+    if (IS_ERR(stack_snapshot_device)) {
+        device_destroy(stack_class, MKDEV(major_number, 0));
+        class_destroy(stack_class);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        kfree(stack);
+        return PTR_ERR(stack_snapshot_device);
+    }
+    
+    stack_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("stats", 0600, stack_debugfs, NULL, &stack_stats_fops);
+    debugfs_create_file("lock_hist", 0600, stack_debugfs, NULL, &stack_lock_hist_fops);
+    debugfs_create_file("image", 0600, stack_debugfs, NULL, &stack_image_fops);
+    
     printk(KERN_INFO "Stack module loaded\n");
     return 0;
 }
 
 // Module cleanup
 static void __exit stack_exit(void) {
+    debugfs_remove_recursive(stack_debugfs);
+    device_destroy(stack_class, MKDEV(major_number, STACK_SNAPSHOT_MINOR));
     device_destroy(stack_class, MKDEV(major_number, 0));
     class_destroy(stack_class);
     unregister_chrdev(major_number, DEVICE_NAME);
     
     if (stack) {
-        if (stack->data)
-            kfree(stack->data);
+        stack_buf_put(rcu_dereference_protected(stack->buf, 1));
+        if (rcu_access_pointer(stack->eventfd))
+            eventfd_ctx_put(rcu_dereference_protected(stack->eventfd, 1));
         kfree(stack);
     }
     
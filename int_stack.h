@@ -0,0 +1,13 @@
+#ifndef INT_STACK_H
+#define INT_STACK_H
+
+// In-kernel interface to the int_stack device for companion modules
+// (such as int_stack_bench) that need to bypass the file operations.
+
+// Push value onto the stack, returns -ERANGE when the stack is full
+int int_stack_push(int value);
+
+// Pop value from the stack, returns -ENODATA when the stack is empty
+int int_stack_pop(int *value);
+
+#endif
@@ -0,0 +1,201 @@
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/debugfs.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/uaccess.h>
+
+#include "int_stack.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Daria Shibkova");
+
+// Benchmark configuration, can be changed between runs via
+// /sys/module/int_stack_bench/parameters/
+static unsigned int threads = 1;
+module_param(threads, uint, 0644);
+MODULE_PARM_DESC(threads, "Number of benchmark kthreads");
+
+static unsigned long ops = 1000000;
+module_param(ops, ulong, 0644);
+MODULE_PARM_DESC(ops, "Push/pop pairs per kthread");
+
+static char *cpus = "";
+module_param(cpus, charp, 0644);
+MODULE_PARM_DESC(cpus, "CPU list to pin kthreads to round-robin (default: all online)");
+
+// Per-thread benchmark state
+struct bench_thread {
+    unsigned int cpu;
+    unsigned long ops;
+    unsigned long failed;
+    u64 ns;
+    struct completion done;
+};
+
+static DEFINE_MUTEX(bench_lock);
+static struct completion bench_start;
+static struct dentry *bench_dir;
+static char bench_result[256];
+
+// Benchmark body - push/pop pairs directly against the stack API
+static int bench_thread_fn(void *arg) {
+    struct bench_thread *t = arg;
+    unsigned long i;
+    int value;
+    u64 start;
+    
+    wait_for_completion(&bench_start);
+    
+    start = ktime_get_ns();
+    for (i = 0; i < t->ops; i++) {
+        if (int_stack_push((int)i))
+            t->failed++;
+        if (int_stack_pop(&value))
+            t->failed++;
+    }
+    t->ns = ktime_get_ns() - start;
+    
+    kthread_complete_and_exit(&t->done, 0);
+}
+
+// Run one benchmark with the current parameters, caller holds bench_lock
+static int bench_run(void) {
+    struct bench_thread *t;
+    struct task_struct *task;
+    cpumask_var_t mask;
+    unsigned int i, cpu, started, nthreads;
+    unsigned long failed = 0, nops;
+    u64 total_ns = 0, start, wall_ns;
+    int ret = 0;
+    
+    if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+        return -ENOMEM;
+        
+    // Take one consistent copy of the parameters, a write through sysfs
+    // frees the old cpus string
+    kernel_param_lock(THIS_MODULE);
+    nthreads = threads;
+    nops = ops;
+    if (cpus && *cpus)
+        ret = cpulist_parse(cpus, mask);
+    else
+        cpumask_copy(mask, cpu_online_mask);
+    kernel_param_unlock(THIS_MODULE);
+    
+    if (!ret && (nthreads == 0 || nops == 0))
+        ret = -EINVAL;
+    if (ret)
+        goto out_mask;
+        
+    cpumask_and(mask, mask, cpu_online_mask);
+    if (cpumask_empty(mask)) {
+        ret = -EINVAL;
+        goto out_mask;
+    }
+    
+    t = kcalloc(nthreads, sizeof(*t), GFP_KERNEL);
+    if (!t) {
+        ret = -ENOMEM;
+        goto out_mask;
+    }
+    
+    init_completion(&bench_start);
+    
+    // Spread threads over the selected CPUs round-robin
+    cpu = cpumask_first(mask);
+    for (i = 0; i < nthreads; i++) {
+        t[i].cpu = cpu;
+        t[i].ops = nops;
+        init_completion(&t[i].done);
+        
+        task = kthread_create(bench_thread_fn, &t[i], "int_stack_bench/%u", i);
+        if (IS_ERR(task)) {
+            ret = PTR_ERR(task);
+            break;
+        }
+        kthread_bind(task, cpu);
+        wake_up_process(task);
+        
+        cpu = cpumask_next(cpu, mask);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(mask);
+    }
+    
+    // Release all started threads at once, even if some failed to start
+    start = ktime_get_ns();
+    complete_all(&bench_start);
+    
+    started = i;
+    for (i = 0; i < started; i++) {
+        wait_for_completion(&t[i].done);
+        total_ns += t[i].ns;
+        failed += t[i].failed;
+    }
+    wall_ns = ktime_get_ns() - start;
+    
+    if (!ret) {
+        scnprintf(bench_result, sizeof(bench_result),
+                  "threads=%u ops=%lu ns/op=%llu mops/s=%llu failed=%lu\n",
+                  started, nops,
+                  div64_u64(total_ns, (u64)started * nops * 2),
+                  div64_u64((u64)started * nops * 2 * 1000, wall_ns ?: 1),
+                  failed);
+        printk(KERN_INFO "int_stack_bench: %s", bench_result);
+    }
+    
+    kfree(t);
+out_mask:
+    free_cpumask_var(mask);
+    return ret;
+}
+
+// Writing anything to "run" starts a benchmark and waits for it to finish
+static ssize_t bench_run_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos) {
+    int ret;
+    
+    mutex_lock(&bench_lock);
+    ret = bench_run();
+    mutex_unlock(&bench_lock);
+    
+    return ret ? ret : count;
+}
+
+// Reading "run" returns the result of the last benchmark
+static ssize_t bench_run_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    ssize_t ret;
+    
+    mutex_lock(&bench_lock);
+    ret = simple_read_from_buffer(buf, count, ppos, bench_result, strlen(bench_result));
+    mutex_unlock(&bench_lock);
+    
+    return ret;
+}
+
+static const struct file_operations bench_run_fops = {
+    .owner = THIS_MODULE,
+    .read = bench_run_read,
+    .write = bench_run_write,
+};
+
+// Module initialization
+static int __init bench_init(void) {
+    bench_dir = debugfs_create_dir("int_stack_bench", NULL);
+    debugfs_create_file("run", 0600, bench_dir, NULL, &bench_run_fops);
+    
+    printk(KERN_INFO "Stack benchmark module loaded\n");
+    return 0;
+}
+
+// Module cleanup
+static void __exit bench_exit(void) {
+    debugfs_remove_recursive(bench_dir);
+    
+    printk(KERN_INFO "Stack benchmark module unloaded\n");
+}
+
+module_init(bench_init);
+module_exit(bench_exit);
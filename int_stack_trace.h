@@ -0,0 +1,90 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM int_stack
+
+#if !defined(_INT_STACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _INT_STACK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Successful push or pop: the value moved and the depth after the operation
+DECLARE_EVENT_CLASS(int_stack_value,
+    TP_PROTO(int value, int depth),
+    TP_ARGS(value, depth),
+    TP_STRUCT__entry(
+        __field(int, value)
+        __field(int, depth)
+    ),
+    TP_fast_assign(
+        __entry->value = value;
+        __entry->depth = depth;
+    ),
+    TP_printk("value=%d depth=%d", __entry->value, __entry->depth)
+);
+
+DEFINE_EVENT(int_stack_value, int_stack_push,
+    TP_PROTO(int value, int depth),
+    TP_ARGS(value, depth)
+);
+
+DEFINE_EVENT(int_stack_value, int_stack_pop,
+    TP_PROTO(int value, int depth),
+    TP_ARGS(value, depth)
+);
+
+// Push rejected because the stack is full
+TRACE_EVENT(int_stack_full,
+    TP_PROTO(int value, int size),
+    TP_ARGS(value, size),
+    TP_STRUCT__entry(
+        __field(int, value)
+        __field(int, size)
+    ),
+    TP_fast_assign(
+        __entry->value = value;
+        __entry->size = size;
+    ),
+    TP_printk("value=%d size=%d", __entry->value, __entry->size)
+);
+
+// Pop attempted on an empty stack
+TRACE_EVENT(int_stack_empty,
+    TP_PROTO(int size),
+    TP_ARGS(size),
+    TP_STRUCT__entry(
+        __field(int, size)
+    ),
+    TP_fast_assign(
+        __entry->size = size;
+    ),
+    TP_printk("size=%d", __entry->size)
+);
+
+// Stack storage reallocated, duration covers allocation and copy
+TRACE_EVENT(int_stack_resize,
+    TP_PROTO(int old_size, int new_size, int copied, u64 duration_ns),
+    TP_ARGS(old_size, new_size, copied, duration_ns),
+    TP_STRUCT__entry(
+        __field(int, old_size)
+        __field(int, new_size)
+        __field(int, copied)
+        __field(u64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->old_size = old_size;
+        __entry->new_size = new_size;
+        __entry->copied = copied;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("old_size=%d new_size=%d copied=%d duration_ns=%llu",
+              __entry->old_size, __entry->new_size, __entry->copied,
+              __entry->duration_ns)
+);
+
+#endif /* _INT_STACK_TRACE_H */
+
+// This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE int_stack_trace
+#include <trace/define_trace.h>
@@ -7,7 +7,31 @@
 #include <errno.h>
 
 #define DEVICE_PATH "/dev/int_stack"
+#define SNAPSHOT_PATH "/dev/int_stack_snapshot"
 #define IOCTL_SET_SIZE _IOW('s', 1, int)
+#define IOCTL_SET_MODE _IOW('s', 2, int)
+#define IOCTL_SET_ENDS _IOW('s', 3, int)
+#define IOCTL_GET_SUM _IOR('s', 4, long long)
+#define IOCTL_GET_MIN _IOR('s', 5, int)
+#define IOCTL_GET_MAX _IOR('s', 6, int)
+#define IOCTL_COUNT_VALUE _IOWR('s', 7, long long)
+#define IOCTL_POP_TIMEOUT _IOWR('s', 11, struct stack_pop_timeout)
+#define IOCTL_GET_DEPTH _IOR('s', 13, int)
+#define IOCTL_GET_SIZE _IOR('s', 14, int)
+#define IOCTL_PEEK _IOR('s', 15, int)
+
+#define STACK_PUSH_BOTTOM 0x1
+#define STACK_POP_BOTTOM 0x2
+
+// IOCTL_POP_TIMEOUT argument
+struct stack_pop_timeout {
+    long long timeout_ns;
+    int value;
+    int reserved;
+};
+
+// Mode names in IOCTL_SET_MODE order
+static const char *mode_names[] = { "lifo", "deque", "fifo", "fifo-spsc", "overwrite", "max-heap", "min-heap" };
 
 // Display usage instructions
 void print_usage() {
@@ -15,7 +39,27 @@ void print_usage() {
     printf("  kernel_stack set-size <size>\n");
     printf("  kernel_stack push <value>\n");
     printf("  kernel_stack pop\n");
+    printf("  kernel_stack pop-wait <timeout_ms>\n");
     printf("  kernel_stack unwind\n");
+    printf("  kernel_stack mode <lifo|deque|fifo|fifo-spsc|overwrite|max-heap|min-heap>\n");
+    printf("  kernel_stack push-bottom <value>\n");
+    printf("  kernel_stack pop-bottom\n");
+    printf("  kernel_stack sum|min|max\n");
+    printf("  kernel_stack count <value>\n");
+    printf("  kernel_stack peek\n");
+    printf("  kernel_stack depth\n");
+    printf("  kernel_stack snapshot\n");
+}
+
+// Look up a mode by name, returns -1 if unknown
+int parse_mode(const char *name) {
+    size_t i;
+    
+    for (i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+        if (strcmp(name, mode_names[i]) == 0)
+            return i;
+    }
+    return -1;
 }
 
 // Main program entry point
@@ -56,13 +100,37 @@ int main(int argc, char *argv[]) {
             return -ret;  // Return negative error code
         }
     }
-    else if (strcmp(argv[1], "push") == 0) {
+    else if (strcmp(argv[1], "mode") == 0) {
+        if (argc != 3 || (value = parse_mode(argv[2])) < 0) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        ret = ioctl(fd, IOCTL_SET_MODE, &value);
+        if (ret < 0) {
+            perror("ERROR: failed to set stack mode");
+            close(fd);
+            return -errno;
+        }
+    }
+    else if (strcmp(argv[1], "push") == 0 || strcmp(argv[1], "push-bottom") == 0) {
         if (argc != 3) {
             print_usage();
             close(fd);
             return 1;
         }
         
+        if (strcmp(argv[1], "push-bottom") == 0) {
+            int ends = STACK_PUSH_BOTTOM;
+            
+            if (ioctl(fd, IOCTL_SET_ENDS, &ends) < 0) {
+                perror("ERROR: bottom push needs deque mode");
+                close(fd);
+                return -errno;
+            }
+        }
+        
         value = atoi(argv[2]);
         ret = write(fd, &value, sizeof(int));
         if (ret < 0) {
@@ -77,13 +145,23 @@ int main(int argc, char *argv[]) {
             }
         }
     }
-    else if (strcmp(argv[1], "pop") == 0) {
+    else if (strcmp(argv[1], "pop") == 0 || strcmp(argv[1], "pop-bottom") == 0) {
         if (argc != 2) {
             print_usage();
             close(fd);
             return 1;
         }
         
+        if (strcmp(argv[1], "pop-bottom") == 0) {
+            int ends = STACK_POP_BOTTOM;
+            
+            if (ioctl(fd, IOCTL_SET_ENDS, &ends) < 0) {
+                perror("ERROR: bottom pop needs deque mode");
+                close(fd);
+                return -errno;
+            }
+        }
+        
         ret = read(fd, &value, sizeof(int));
         if (ret == 0) {
             printf("NULL\n");
@@ -97,6 +175,29 @@ int main(int argc, char *argv[]) {
             printf("%d\n", value);
         }
     }
+    else if (strcmp(argv[1], "pop-wait") == 0) {
+        struct stack_pop_timeout req = { 0 };
+        
+        if (argc != 3) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        req.timeout_ns = atoll(argv[2]) * 1000000LL;
+        ret = ioctl(fd, IOCTL_POP_TIMEOUT, &req);
+        if (ret < 0) {
+            if (errno == ETIMEDOUT) {
+                printf("NULL\n");
+                close(fd);
+                return 0;  // Same as popping an empty stack
+            }
+            perror("Failed to pop value");
+            close(fd);
+            return -errno;
+        }
+        printf("%d\n", req.value);
+    }
     else if (strcmp(argv[1], "unwind") == 0) {
         if (argc != 2) {
             print_usage();
@@ -117,6 +218,113 @@ int main(int argc, char *argv[]) {
             }
         }
     }
+    else if (strcmp(argv[1], "sum") == 0 || strcmp(argv[1], "count") == 0) {
+        long long result;
+        int count = strcmp(argv[1], "count") == 0;
+        
+        if (argc != (count ? 3 : 2)) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        result = count ? atoi(argv[2]) : 0;
+        ret = ioctl(fd, count ? IOCTL_COUNT_VALUE : IOCTL_GET_SUM, &result);
+        if (ret < 0) {
+            perror("ERROR: failed to query stack");
+            close(fd);
+            return -errno;
+        }
+        printf("%lld\n", result);
+    }
+    else if (strcmp(argv[1], "min") == 0 || strcmp(argv[1], "max") == 0) {
+        if (argc != 2) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        ret = ioctl(fd, strcmp(argv[1], "min") == 0 ? IOCTL_GET_MIN : IOCTL_GET_MAX, &value);
+        if (ret < 0) {
+            if (errno == ENODATA) {
+                printf("NULL\n");
+                close(fd);
+                return 0;  // Same as popping an empty stack
+            }
+            perror("ERROR: failed to query stack");
+            close(fd);
+            return -errno;
+        }
+        printf("%d\n", value);
+    }
+    else if (strcmp(argv[1], "peek") == 0) {
+        if (argc != 2) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        ret = ioctl(fd, IOCTL_PEEK, &value);
+        if (ret < 0) {
+            if (errno == ENODATA) {
+                printf("NULL\n");
+                close(fd);
+                return 0;  // Same as popping an empty stack
+            }
+            perror("ERROR: failed to peek");
+            close(fd);
+            return -errno;
+        }
+        printf("%d\n", value);
+    }
+    else if (strcmp(argv[1], "depth") == 0) {
+        int size;
+        
+        if (argc != 2) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        // Neither query takes the stack lock, cheap enough to poll
+        if (ioctl(fd, IOCTL_GET_DEPTH, &value) < 0 || ioctl(fd, IOCTL_GET_SIZE, &size) < 0) {
+            perror("ERROR: failed to query stack");
+            close(fd);
+            return -errno;
+        }
+        printf("%d/%d\n", value, size);
+    }
+    else if (strcmp(argv[1], "snapshot") == 0) {
+        int values[4096];
+        int snap_fd;
+        int i;
+        
+        if (argc != 2) {
+            print_usage();
+            close(fd);
+            return 1;
+        }
+        
+        snap_fd = open(SNAPSHOT_PATH, O_RDONLY);
+        if (snap_fd < 0) {
+            perror("Failed to open snapshot device");
+            close(fd);
+            return 1;
+        }
+        
+        // Bottom to top, the stack itself is left untouched
+        while ((ret = read(snap_fd, values, sizeof(values))) > 0) {
+            for (i = 0; i < ret / (int)sizeof(int); i++)
+                printf("%d\n", values[i]);
+        }
+        if (ret < 0) {
+            perror("Failed to read snapshot");
+            close(snap_fd);
+            close(fd);
+            return -errno;
+        }
+        close(snap_fd);
+    }
     else {
         print_usage();
         close(fd);
@@ -125,4 +333,4 @@ int main(int argc, char *argv[]) {
 
     close(fd);
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file